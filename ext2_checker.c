@@ -1,39 +1,196 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "ext2_utils.h"
 
 
-#define USAGE "Usage: %s <image file name>\n"
+#define USAGE "Usage: %s <image file name> [-n] [-l] [-c] "\
+                        "[--incremental] [-j <number of threads>]\n"
 
-#define NUM_ARGUMENT_V 2
+#define THREADS_FLAG "-j"
+#define LINEAR_FLAG "-l"
+#define CLONE_FLAG "-c"
+#define DRY_RUN_FLAG "-n"
+#define INCREMENTAL_FLAG "--incremental"
+
+#define MIN_ARGUMENT_V 2
+
+// Issues found for an inode while scanning it, to be repaired afterwards
+#define ISSUE_NOT_IN_USE 0x1     // Inode not marked in the inode bitmap
+#define ISSUE_DTIME      0x2     // Reachable inode has a deletion time
+#define ISSUE_BLOCKS     0x4     // Data blocks not marked in the block bitmap
+
+// Directory that orphaned inodes are reconnected to
+#define LOST_FOUND_DIR "lost+found"
+
+// Longest name of a reconnected inode ("#" and the inode number)
+#define MAX_ORPHAN_NAME_LEN 16
+
+// Longest label of an inode claiming a duplicate block (" [<inode number>]")
+#define MAX_OWNER_LABEL_LEN 16
+
+// Severity of a reported issue
+#define REPORT_FIXED 0
+#define REPORT_WARNING 1
+
+// Largest number of phases timed in one run
+#define MAX_PHASES 8
 
 #define FILE_TYPE(I_MODE) ((I_MODE >> 12))
-#define IS_DIR(I_MODE) ((I_MODE >> 12) == (EXT2_S_IFDIR >> 12))
 
 unsigned char *disk = NULL;
 
+// Whether repairs are only reported (-n), with the image mapped read-only
+int dry_run = FALSE;
+
+// Whether only the inodes in the dirty log are checked (--incremental)
+int incremental = FALSE;
+
+// Changes to link counts that a dry run would have made on disk
+short *pending_links = NULL;
+
+
+/*
+ * An issue found by the checker, kept for the report of a dry run.
+ */
+struct report_entry {
+    int severity;       // REPORT_FIXED, or REPORT_WARNING
+    char *type;         // Short name for the kind of issue
+    char *message;
+};
+
+struct report_entry *report_entries = NULL;
+int num_report_entries = 0;
+int max_report_entries = 0;
+
+
+/*
+ * Time taken, and work done, by one phase of the check.
+ */
+struct check_phase {
+    char *name;
+    double seconds;
+    unsigned long long bytes_scanned;
+    unsigned long long inodes_visited;
+};
+
+struct check_phase phases[MAX_PHASES];
+int num_phases = 0;
+int phase_open = FALSE;
+
+// Work done so far, charged to the phase that is open
+unsigned long long bytes_scanned = 0;
+unsigned long long inodes_visited = 0;
+
 
 /*
- * Return the total number of bits set to 0 in the given bitmap.
+ * Reports an issue. Normally the issue has just been repaired (or can not
+ * be, for a warning) and is printed right away; in a dry run it is kept
+ * for the report instead.
  */
-unsigned int get_num_low_bits(unsigned char *bitmap, int bitmap_size) {
+void report(int severity, char *type, const char *format, ...) {
+    va_list args;
+    
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    
+    char *message = malloc(len + 1);
+    
+    if (message == NULL) {
+        exit(ENOMEM);
+    }
+    
+    va_start(args, format);
+    vsnprintf(message, len + 1, format, args);
+    va_end(args);
     
-    int i, num_low_bits = 0;
+    if (!dry_run) {
+        printf("%s: %s\n", (severity == REPORT_FIXED) ? "Fixed" : "Warning",
+               message);
+        free(message);
+        return;
+    }
     
-    for (i = 0; i < bitmap_size; i++) {
-        unsigned char curr_byte = bitmap[i];
+    if (num_report_entries == max_report_entries) {
+        max_report_entries = max_report_entries ? 2 * max_report_entries :
+                                                  MAX_PHASES;
+        report_entries = realloc(report_entries, max_report_entries *
+                                 sizeof(struct report_entry));
         
-        int curr_bit;
-        for (curr_bit = 0; curr_bit < CHAR_BIT; curr_bit++) {
-            
-            if (!IS_IN_USE(curr_byte, curr_bit)) {
-                num_low_bits++;
-            }
+        if (report_entries == NULL) {
+            exit(ENOMEM);
         }
     }
     
-    return num_low_bits;
+    report_entries[num_report_entries].severity = severity;
+    report_entries[num_report_entries].type = type;
+    report_entries[num_report_entries].message = message;
+    num_report_entries++;
+}
+
+
+/*
+ * Ends the phase that is open (if any), recording the time it took and
+ * the work it did.
+ */
+void end_phase() {
+    
+    if (!phase_open) {
+        return;
+    }
+    
+    struct check_phase *phase = &phases[num_phases - 1];
+    
+    phase->seconds = get_seconds() - phase->seconds;
+    phase->bytes_scanned = bytes_scanned - phase->bytes_scanned;
+    phase->inodes_visited = inodes_visited - phase->inodes_visited;
+    phase_open = FALSE;
+}
+
+
+/*
+ * Ends the phase that is open, and starts timing a new one.
+ */
+void begin_phase(char *name) {
+    
+    end_phase();
+    
+    if (num_phases == MAX_PHASES) {
+        return;
+    }
+    
+    struct check_phase *phase = &phases[num_phases++];
+    
+    phase->name = name;
+    phase->seconds = get_seconds();
+    phase->bytes_scanned = bytes_scanned;
+    phase->inodes_visited = inodes_visited;
+    phase_open = TRUE;
+}
+
+
+/*
+ * Return the total number of bits set to 0 among the first bitmap_size bits
+ * of the bitmap stored from the given block on. The bitmap is read through
+ * once from start to end, which the kernel is told to expect.
+ */
+unsigned int get_num_low_bits(unsigned int bitmap_block, int bitmap_size) {
+    
+    unsigned char *bitmap = BLOCK_START(disk, bitmap_block);
+    int num_blocks = (bitmap_size / CHAR_BIT + EXT2_BLOCK_SIZE) /
+                                                        EXT2_BLOCK_SIZE;
+    
+    advise_blocks(bitmap_block, num_blocks, MADV_SEQUENTIAL);
+    unsigned int num_set = count_set_bits(bitmap, bitmap_size);
+    advise_blocks(bitmap_block, num_blocks, MADV_NORMAL);
+    
+    return bitmap_size - num_set;
 }
 
 
@@ -42,10 +199,12 @@ unsigned int get_num_low_bits(unsigned char *bitmap, int bitmap_size) {
  */
 unsigned int get_free_inodes_count() {
     
-    unsigned char *inode_bitmap = get_inode_bitmap();
+    unsigned int bitmap_block = get_group_descriptor()->bg_inode_bitmap;
     int bitmap_size = get_inodes_count();
     
-    return get_num_low_bits(inode_bitmap, bitmap_size);
+    bytes_scanned += bitmap_size / CHAR_BIT;
+    
+    return get_num_low_bits(bitmap_block, bitmap_size);
 }
 
 /*
@@ -53,10 +212,12 @@ unsigned int get_free_inodes_count() {
  */
 unsigned int get_free_blocks_count() {
     
-    unsigned char *block_bitmap = get_block_bitmap();
+    unsigned int bitmap_block = get_group_descriptor()->bg_block_bitmap;
     int bitmap_size = get_blocks_count();
     
-    return get_num_low_bits(block_bitmap, bitmap_size);
+    bytes_scanned += bitmap_size / CHAR_BIT;
+    
+    return get_num_low_bits(bitmap_block, bitmap_size);
 }
 
 
@@ -80,21 +241,61 @@ unsigned int fix_free_inodes_count() {
                                   (int) gd->bg_free_inodes_count);
     
     if (delta_with_super_blk != 0) {
-        sb->s_free_inodes_count = num_free_inodes;
-        printf("Fixed: superblock's free inodes counter was off by %d "\
-               "compared to the bitmap\n", delta_with_super_blk);
+        if (!dry_run) {
+            sb->s_free_inodes_count = num_free_inodes;
+        }
+        report(REPORT_FIXED, "free_inodes_count", "superblock's free inodes "\
+               "counter was off by %d compared to the bitmap",
+               delta_with_super_blk);
     }
     
     if (delta_with_grp_desc != 0) {
-        gd->bg_free_inodes_count = num_free_inodes;
-        printf("Fixed: block group's free inodes counter was off by %d "\
-               "compared to the bitmap\n", delta_with_grp_desc);
+        if (!dry_run) {
+            gd->bg_free_inodes_count = num_free_inodes;
+        }
+        report(REPORT_FIXED, "free_inodes_count", "block group's free inodes "\
+               "counter was off by %d compared to the bitmap",
+               delta_with_grp_desc);
     }
     
     return delta_with_super_blk + delta_with_grp_desc;
 }
 
 
+/*
+ * Ensure that every inode marked in-use in the bitmap lies in the part of
+ * the inode table counted as initialized (see ext2_mkfs), so that the scans
+ * which stop there don't miss it.
+ *
+ * Return the number of inodes that were past the end of the initialized
+ * part of the table.
+ */
+unsigned int fix_initialized_inodes_count() {
+    unsigned int inodes_count = get_inodes_count();
+    unsigned int initialized = get_initialized_inodes_count();
+    
+    unsigned int inode_num = inodes_count;
+    while (inode_num > initialized && !is_inode_in_use(inode_num)) {
+        inode_num--;
+    }
+    
+    bytes_scanned += (inodes_count - initialized) / CHAR_BIT;
+    
+    if (inode_num == initialized) {
+        return 0;
+    }
+    
+    if (!dry_run) {
+        initialize_inode(inode_num);
+    }
+    report(REPORT_FIXED, "itable_unused", "inode %u in use past the end "\
+           "of the initialized inode table (%u inodes)", inode_num,
+           initialized);
+    
+    return 1;
+}
+
+
 /*
  * Ensure that the superblock and block group counters for free blocks
  * are consistent with the block bitmap.
@@ -115,15 +316,21 @@ unsigned int fix_free_blocks_count() {
                                   (int) gd->bg_free_blocks_count);
     
     if (delta_with_super_blk != 0) {
-        sb->s_free_blocks_count = num_free_blocks;
-        printf("Fixed: superblock's free blocks counter was off by %d "\
-               "compared to the bitmap\n", delta_with_super_blk);
+        if (!dry_run) {
+            sb->s_free_blocks_count = num_free_blocks;
+        }
+        report(REPORT_FIXED, "free_blocks_count", "superblock's free blocks "\
+               "counter was off by %d compared to the bitmap",
+               delta_with_super_blk);
     }
     
     if (delta_with_grp_desc != 0) {
-        gd->bg_free_blocks_count = num_free_blocks;
-        printf("Fixed: block group's free blocks counter was off by %d "\
-               "compared to the bitmap\n", delta_with_grp_desc);
+        if (!dry_run) {
+            gd->bg_free_blocks_count = num_free_blocks;
+        }
+        report(REPORT_FIXED, "free_blocks_count", "block group's free blocks "\
+               "counter was off by %d compared to the bitmap",
+               delta_with_grp_desc);
     }
     
     return delta_with_super_blk + delta_with_grp_desc;
@@ -167,10 +374,12 @@ int fix_file_type_mismatch(struct ext2_dir_entry *entry) {
     unsigned char expected = dir_entry_file_type(inode->i_mode);
     
     if (entry->file_type != expected) {
-        entry->file_type = expected;
+        if (!dry_run) {
+            entry->file_type = expected;
+        }
         fixed++;
-        printf("Fixed: Entry type vs inode mismatch: inode [%d]\n",
-               entry->inode);
+        report(REPORT_FIXED, "file_type", "Entry type vs inode mismatch: "\
+               "inode [%d]", entry->inode);
     }
     
     return fixed;
@@ -191,9 +400,12 @@ int fix_inode_allocation_inconsistency(unsigned int inode_num) {
     // Update inode bitmap (and block group and superblock counters) if this
     // inode is not marked as allocated
     if (!is_inode_in_use(inode_num)) {
-        set_inode_in_use(inode_num);
+        if (!dry_run) {
+            set_inode_in_use(inode_num);
+        }
         fixed++;
-        printf("Fixed: inode [%d] not marked as in-use\n", inode_num);
+        report(REPORT_FIXED, "inode_not_in_use", "inode [%d] not marked as "\
+               "in-use", inode_num);
         
     }
     
@@ -214,9 +426,12 @@ int fix_inode_deletion_time(unsigned int inode_num) {
     struct ext2_inode *inode = get_inode_table() + INDEX(inode_num);
     
     if (inode->i_dtime) {
-        inode->i_dtime = UNDEFINED;
+        if (!dry_run) {
+            inode->i_dtime = UNDEFINED;
+        }
         fixed++;
-        printf("Fixed: valid inode marked for deletion: [%d]\n", inode_num);
+        report(REPORT_FIXED, "deletion_time", "valid inode marked for "\
+               "deletion: [%d]", inode_num);
     }
     
     return fixed;
@@ -240,7 +455,9 @@ int fix_data_block_allocation(unsigned int inode_num) {
         unsigned int block_num = inode->i_block[n];
         
         if (block_num != UNDEFINED && !is_block_in_use(block_num)) {
-            set_block_in_use(block_num);
+            if (!dry_run) {
+                set_block_in_use(block_num);
+            }
             num_fixed++;
         }
     }
@@ -251,7 +468,9 @@ int fix_data_block_allocation(unsigned int inode_num) {
     if (indirect_block_num != UNDEFINED) {
         
         if (!is_block_in_use(indirect_block_num)) {
-            set_block_in_use(indirect_block_num);
+            if (!dry_run) {
+                set_block_in_use(indirect_block_num);
+            }
             num_fixed++;
         }
         
@@ -270,7 +489,9 @@ int fix_data_block_allocation(unsigned int inode_num) {
             if (direct_block_num != UNDEFINED &&
                 !is_block_in_use(direct_block_num)) {
                 
-                set_block_in_use(direct_block_num);
+                if (!dry_run) {
+                    set_block_in_use(direct_block_num);
+                }
                 num_fixed++;
             }
             direct_block_num = *(pos++);
@@ -278,8 +499,8 @@ int fix_data_block_allocation(unsigned int inode_num) {
     }
     
     if (num_fixed) {
-        printf("Fixed: %d in-use data blocks not marked in data bitmap "\
-               "for inode: [%d]\n", num_fixed, inode_num);
+        report(REPORT_FIXED, "block_not_in_use", "%d in-use data blocks not "\
+               "marked in data bitmap for inode: [%d]", num_fixed, inode_num);
     }
     
     return num_fixed;
@@ -287,107 +508,1688 @@ int fix_data_block_allocation(unsigned int inode_num) {
 
 
 /*
- * Recursively checks the file system for inconsistencies, and takes
- * appropriate measures to fix them.
+ * A directory block, along with the directory it belongs to.
+ */
+struct dir_block_ref {
+    unsigned int block_num;
+    unsigned int dir_inode_num;
+};
+
+
+int compare_dir_block_refs(const void *a, const void *b) {
+    struct dir_block_ref *x = (struct dir_block_ref *) a;
+    struct dir_block_ref *y = (struct dir_block_ref *) b;
+    
+    return (x->block_num > y->block_num) - (x->block_num < y->block_num);
+}
+
+
+/*
+ * Appends the (in range) direct blocks of the directory with the given inode
+ * to `refs`.
  *
- * Returns the total number of inconsistencies fixed.
+ * Returns the new number of blocks in `refs`.
  */
-int fix_dir_entries_recursively(struct ext2_dir_entry *entry,
-                                         int is_root) {
+int add_dir_blocks(unsigned int dir_inode_num, struct dir_block_ref *refs,
+                   int num_refs) {
     
-    struct ext2_inode *inode = get_inode_table() + INDEX(entry->inode);
+    struct ext2_inode *inode = get_inode_table() + INDEX(dir_inode_num);
+    unsigned int blocks_count = get_blocks_count();
+    
+    int n;
+    for (n = 0; n < NUM_DIRECT_PTRS && (inode->i_block)[n] != 0; n++) {
+        if ((inode->i_block)[n] < blocks_count) {
+            refs[num_refs].block_num = (inode->i_block)[n];
+            refs[num_refs].dir_inode_num = dir_inode_num;
+            num_refs++;
+        }
+    }
+    
+    return num_refs;
+}
+
+
+/*
+ * Asks for the given directory blocks to be read in ahead of the scan over
+ * them, so that the scan does not fault them in one page at a time.
+ */
+void prefetch_dir_blocks(struct dir_block_ref *refs, int num_refs) {
+    
+    unsigned int *block_nums = malloc(num_refs * sizeof(unsigned int));
+    
+    if (block_nums == NULL) {
+        exit(ENOMEM);
+    }
+    
+    int i;
+    for (i = 0; i < num_refs; i++) {
+        block_nums[i] = refs[i].block_num;
+    }
+    
+    prefetch_blocks(block_nums, num_refs);
+    
+    free(block_nums);
+}
+
+
+/*
+ * Changes the number of entries counted towards the given inode's link
+ * count by `delta`. If the counts are only made later, from the disk
+ * (`link_counts` is NULL), a dry run keeps the change aside, since it is
+ * not made on disk.
+ */
+void adjust_link_count(unsigned short *link_counts, unsigned int inode_num,
+                       int delta) {
     
-    int num_fixed = fix_file_type_mismatch(entry) +
-                    fix_inode_allocation_inconsistency(entry->inode) +
-                    fix_inode_deletion_time(entry->inode) +
-                    fix_data_block_allocation(entry->inode);
+    if (link_counts != NULL) {
+        link_counts[INDEX(inode_num)] += delta;
+        return;
+    }
     
-    // Stop recursing if the this dir entry is not a directory
-    if (entry->file_type != EXT2_FT_DIR) {
-        return num_fixed;
+    if (!dry_run) {
+        return;
     }
     
-    // Stop recursing if this dir entry is not the root, and refers to itself
-    // or its parent
-    else if (!is_root &&
-             (strncmp(entry->name, CURRENT_DIR, strlen(CURRENT_DIR)) == 0 ||
-              strncmp(entry->name, PARENT_DIR, strlen(PARENT_DIR)) == 0)) {
+    if (pending_links == NULL) {
+        pending_links = calloc(get_inodes_count(), sizeof(short));
         
-        return num_fixed;
+        if (pending_links == NULL) {
+            exit(ENOMEM);
+        }
     }
     
-    // Iterate over directly entry blocks and fix recursively
-    int n;
-    for (n = 0; n < NUM_DIRECT_PTRS && (inode->i_block)[n] != 0; n++) {
+    pending_links[INDEX(inode_num)] += delta;
+}
+
+
+/*
+ * Clears the given entry (inside the directory with inode `dir_inode_num`),
+ * which names a directory that already has an entry elsewhere in the tree.
+ * A directory can only have one name, so this one is taken back out of
+ * the link counts (see adjust_link_count) rather than counted as a link.
+ *
+ * Always returns 1, the number of inconsistencies fixed.
+ */
+int fix_dir_hard_link(struct ext2_dir_entry *entry,
+                      unsigned int dir_inode_num,
+                      unsigned short *link_counts) {
+    
+    report(REPORT_FIXED, "dir_hard_link", "entry '%.*s' in directory [%u] "\
+           "was a second link to directory [%u]", entry->name_len,
+           entry->name, dir_inode_num, entry->inode);
+    
+    unsigned int inode_num = entry->inode;
+    
+    if (!dry_run) {
+        entry->inode = UNDEFINED;
+    }
+    
+    adjust_link_count(link_counts, inode_num, -1);
+    
+    return 1;
+}
+
+
+/*
+ * Walks the directory tree breadth first, marking every inode it reaches in
+ * `reachable`. Directory entries whose file_type does not match their inode
+ * are fixed on the way, since they steer the walk.
+ *
+ * The blocks of each level of the tree are scanned in order of block
+ * number. Every directory is descended into at most once, so a cycle made
+ * by corrupted entries can not trap the walk, and memory use is bounded by
+ * the number of inodes rather than the depth of the tree.
+ *
+ * Returns the total number of inconsistencies fixed.
+ */
+int mark_reachable_entries(struct ext2_dir_entry *root_entry,
+                           unsigned char *reachable) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned int inodes_count = get_inodes_count();
+    
+    unsigned char *visited = calloc(inodes_count, sizeof(unsigned char));
+    struct dir_block_ref *refs = malloc(inodes_count * NUM_DIRECT_PTRS *
+                                        sizeof(struct dir_block_ref));
+    
+    if (visited == NULL || refs == NULL) {
+        exit(ENOMEM);
+    }
+    
+    int num_fixed = fix_file_type_mismatch(root_entry);
+    reachable[INDEX(root_entry->inode)] = TRUE;
+    visited[INDEX(root_entry->inode)] = TRUE;
+    inodes_visited++;
+    
+    // Blocks of the directories on the current level of the tree
+    int num_refs = add_dir_blocks(root_entry->inode, refs, 0);
+    
+    while (num_refs > 0) {
         
-        int block_num = (inode->i_block)[n];
+        qsort(refs, num_refs, sizeof(struct dir_block_ref),
+              compare_dir_block_refs);
+        prefetch_dir_blocks(refs, num_refs);
         
-        unsigned char *block_start = BLOCK_START(disk, block_num);
-        unsigned char *block_end = BLOCK_END(block_start);
+        // Blocks of the next level are appended behind the current ones
+        int level_end = num_refs;
+        bytes_scanned += (unsigned long long) level_end * EXT2_BLOCK_SIZE;
         
-        // Current position within this block
-        unsigned char *pos = block_start;
-    
-        while (pos != block_end) {
-            struct ext2_dir_entry *curr_entry = (struct ext2_dir_entry *) pos;
+        int i;
+        for (i = 0; i < level_end; i++) {
             
-            // Just a sanity check to ensure that the directory entry
-            // is in use
-            if (curr_entry->inode != UNDEFINED) {
-                num_fixed += fix_dir_entries_recursively(curr_entry, FALSE);
-            }
+            unsigned char *block_start = BLOCK_START(disk, refs[i].block_num);
+            unsigned char *block_end = BLOCK_END(block_start);
+            
+            // Current position within this block
+            unsigned char *pos = block_start;
             
-            pos += curr_entry->rec_len;
+            while (pos < block_end) {
+                struct ext2_dir_entry *entry = (struct ext2_dir_entry *) pos;
+                
+                // Dir entry is blank / zeroed out / has invalid rec_len
+                if (entry->rec_len == 0) {
+                    break;
+                }
+                
+                pos += entry->rec_len;
+                
+                // Just a sanity check to ensure that the directory entry
+                // is in use
+                if (entry->inode == UNDEFINED ||
+                    entry->inode > inodes_count) {
+                    continue;
+                }
+                
+                num_fixed += fix_file_type_mismatch(entry);
+                reachable[INDEX(entry->inode)] = TRUE;
+                
+                // Descend into each directory only once, and never through
+                // entries for itself or its parent
+                struct ext2_inode *inode = i_table + INDEX(entry->inode);
+                
+                if (!IS_DIR(inode->i_mode) || is_self_or_parent_entry(entry)) {
+                    continue;
+                }
+                
+                // The shallowest name of a directory is the one kept
+                if (visited[INDEX(entry->inode)]) {
+                    num_fixed += fix_dir_hard_link(entry,
+                                                   refs[i].dir_inode_num,
+                                                   NULL);
+                    continue;
+                }
+                
+                visited[INDEX(entry->inode)] = TRUE;
+                inodes_visited++;
+                num_refs = add_dir_blocks(entry->inode, refs, num_refs);
+            }
         }
+        
+        // Move the next level to the front
+        memmove(refs, refs + level_end,
+                (num_refs - level_end) * sizeof(struct dir_block_ref));
+        num_refs -= level_end;
     }
     
+    free(refs);
+    free(visited);
+    
     return num_fixed;
 }
 
 
 /*
- * Detects a small subset of possible file system inconsistencies and takes
- * appropriate actions to fix them.
- *
- * Returns the total number of inconsistencies fixed.
+ * Blocks found to be claimed more than once. The table only grows when a
+ * duplicate is found, so its size is proportional to the number of
+ * duplicates rather than to the size of the image.
  */
-unsigned int fix_inconsistencies() {
-    int num_fixed = 0;
-    struct ext2_inode *root_dir_inode = get_inode_table() + EXT2_ROOT_INO_IDX;
+struct dup_blocks {
+    unsigned int *block_nums;
+    int num;
+    int max;
+};
+
+
+/*
+ * Adds the given block to the table of duplicates.
+ */
+void add_dup_block(struct dup_blocks *dups, unsigned int block_num) {
     
-    // Root inode MUST have a type of 'directory'
-    // Fix it, if it doesn't
-    if (!IS_DIR(root_dir_inode->i_mode)) {
-        root_dir_inode->i_mode |= EXT2_S_IFDIR;
-        num_fixed++;
-        printf("Fixed: Root inode not marked as directory\n");
+    if (dups->num == dups->max) {
+        dups->max = dups->max ? 2 * dups->max : EXT2_BLOCK_SIZE;
+        dups->block_nums = realloc(dups->block_nums,
+                                   dups->max * sizeof(unsigned int));
+        
+        if (dups->block_nums == NULL) {
+            exit(ENOMEM);
+        }
     }
     
-    struct ext2_dir_entry *root_entry = (struct ext2_dir_entry *)
-                                BLOCK_START(disk, root_dir_inode->i_block[0]);
+    dups->block_nums[dups->num++] = block_num;
+}
+
+
+/*
+ * Sorts the table of duplicates, and drops repeated block numbers (blocks
+ * claimed more than twice are added more than once).
+ */
+void sort_dup_blocks(struct dup_blocks *dups) {
     
-    num_fixed += fix_free_inodes_count() +
-                 fix_free_blocks_count() +
-                 fix_dir_entries_recursively(root_entry, TRUE);
+    qsort(dups->block_nums, dups->num, sizeof(unsigned int),
+          compare_block_nums);
     
-    return num_fixed;
+    int i, num_unique = 0;
+    for (i = 0; i < dups->num; i++) {
+        if (num_unique == 0 ||
+            dups->block_nums[num_unique - 1] != dups->block_nums[i]) {
+            dups->block_nums[num_unique++] = dups->block_nums[i];
+        }
+    }
+    
+    dups->num = num_unique;
 }
 
 
-int main(int argc, char *argv[]) {
+/*
+ * Returns TRUE if the given block is in the (sorted) table of duplicates.
+ */
+int is_dup_block(struct dup_blocks *dups, unsigned int block_num) {
+    return dups->num > 0 &&
+           bsearch(&block_num, dups->block_nums, dups->num,
+                   sizeof(unsigned int), compare_block_nums) != NULL;
+}
+
+
+/*
+ * Records that a block is claimed. Blocks that were claimed already are
+ * added to the table of duplicates.
+ */
+void claim_block(unsigned char *claimed, struct dup_blocks *dups,
+                 unsigned int block_num) {
     
-    if (argc != NUM_ARGUMENT_V) {
-        fprintf(stderr, USAGE, argv[0]);
-        return EXIT_FAILURE;
+    int byte_index = block_num / CHAR_BIT;
+    int bit_offset = block_num % CHAR_BIT;
+    
+    if (IS_IN_USE(claimed[byte_index], bit_offset)) {
+        add_dup_block(dups, block_num);
     }
+    else {
+        claimed[byte_index] |= (1 << bit_offset);
+    }
+}
+
+
+/*
+ * A contiguous range of the inode table, scanned by one worker thread.
+ * Each shard has its own tables, so workers never write to shared memory
+ * (apart from their own slice of `issues`).
+ */
+struct check_shard {
+    pthread_t thread;
+    unsigned int first_inode_num;   // First inode of the range
+    unsigned int end_inode_num;     // One past the last inode of the range
+    unsigned char *reachable;       // Inodes reachable from the root
+    unsigned char *issues;          // ISSUE_* flags for each inode
+    unsigned char *claimed;         // Bitmap of the blocks claimed so far
+    struct dup_blocks dups;         // Blocks claimed more than once
+    unsigned short *link_counts;    // Number of entries linking each inode
+    int count_links;                // Whether link_counts is to be built
+    unsigned long long bytes_scanned;
+    unsigned long long inodes_visited;
+};
+
+
+/*
+ * Counts the directory entries inside the given directory towards the
+ * link count of the inodes they refer to.
+ *
+ * Returns the number of directory blocks scanned.
+ */
+int count_dir_links(struct ext2_inode *dir_inode,
+                    unsigned short *link_counts) {
     
-    char *disk_image_path = argv[1];
+    unsigned int blocks_count = get_blocks_count();
+    unsigned int inodes_count = get_inodes_count();
+    int num_scanned = 0;
+    
+    int n;
+    for (n = 0; n < NUM_DIRECT_PTRS && (dir_inode->i_block)[n] != 0; n++) {
+        
+        unsigned int block_num = (dir_inode->i_block)[n];
+        
+        if (block_num >= blocks_count) {
+            continue;
+        }
+        
+        unsigned char *block_start = BLOCK_START(disk, block_num);
+        unsigned char *block_end = BLOCK_END(block_start);
+        unsigned char *pos = block_start;
+        
+        while (pos < block_end) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *) pos;
+            
+            if (entry->rec_len == 0) {
+                break;
+            }
+            
+            if (entry->inode != UNDEFINED && entry->inode <= inodes_count) {
+                link_counts[INDEX(entry->inode)]++;
+            }
+            
+            pos += entry->rec_len;
+        }
+        num_scanned++;
+    }
     
-    disk = read_disk_image(disk_image_path);
+    return num_scanned;
+}
+
+
+/*
+ * Worker thread: scans the reachable inodes in its shard without modifying
+ * the disk image, and records what needs to be repaired.
+ */
+void *scan_shard(void *arg) {
+    struct check_shard *shard = (struct check_shard *) arg;
+    struct ext2_inode *i_table = get_inode_table();
     
-    unsigned int num_fixed = fix_inconsistencies();
+    unsigned int blocks[MAX_INODE_BLOCKS];
+    unsigned int inode_num;
     
-    if (num_fixed) {
+    for (inode_num = shard->first_inode_num;
+         inode_num < shard->end_inode_num; inode_num++) {
+        
+        if (!shard->reachable[INDEX(inode_num)]) {
+            continue;
+        }
+        
+        struct ext2_inode *inode = i_table + INDEX(inode_num);
+        unsigned char issues = 0;
+        
+        shard->inodes_visited++;
+        shard->bytes_scanned += sizeof(struct ext2_inode);
+        if (inode->i_block[NUM_DIRECT_PTRS] != UNDEFINED) {
+            shard->bytes_scanned += EXT2_BLOCK_SIZE;
+        }
+        
+        if (!is_inode_in_use(inode_num)) {
+            issues |= ISSUE_NOT_IN_USE;
+        }
+        if (inode->i_dtime) {
+            issues |= ISSUE_DTIME;
+        }
+        
+        // Claim the inode's blocks, and check that they are marked in-use
+        int i, num_blocks = collect_inode_blocks(inode, blocks);
+        
+        for (i = 0; i < num_blocks; i++) {
+            unsigned int block_num = blocks[i];
+            
+            claim_block(shard->claimed, &shard->dups, block_num);
+            if (!is_block_in_use(block_num)) {
+                issues |= ISSUE_BLOCKS;
+            }
+        }
+        
+        if (shard->count_links && IS_DIR(inode->i_mode)) {
+            shard->bytes_scanned += EXT2_BLOCK_SIZE *
+                            count_dir_links(inode, shard->link_counts);
+        }
+        
+        shard->issues[INDEX(inode_num)] = issues;
+    }
+    
+    return NULL;
+}
+
+
+/*
+ * Asks for the indirect blocks of the inodes marked in `reachable` to be
+ * read in, in order of block number, before the shards follow them.
+ */
+void prefetch_indirect_blocks(unsigned char *reachable) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned int inodes_count = get_inodes_count();
+    unsigned int blocks_count = get_blocks_count();
+    
+    unsigned int *block_nums = malloc(inodes_count * sizeof(unsigned int));
+    
+    if (block_nums == NULL) {
+        exit(ENOMEM);
+    }
+    
+    int num_blocks = 0;
+    unsigned int inode_num;
+    
+    for (inode_num = NUM(0); inode_num <= inodes_count; inode_num++) {
+        unsigned int block_num =
+                    i_table[INDEX(inode_num)].i_block[NUM_DIRECT_PTRS];
+        
+        if (reachable[INDEX(inode_num)] && block_num != UNDEFINED &&
+            block_num < blocks_count) {
+            block_nums[num_blocks++] = block_num;
+        }
+    }
+    
+    prefetch_blocks(block_nums, num_blocks);
+    
+    free(block_nums);
+}
+
+
+/*
+ * Ensure that the links_count of the given inode matches the number of
+ * directory entries that refer to it.
+ *
+ * Return 0, if it was already correct.
+ * Return 1, otherwise.
+ */
+int fix_links_count(unsigned int inode_num, unsigned short num_links) {
+    
+    struct ext2_inode *inode = get_inode_table() + INDEX(inode_num);
+    
+    if (inode->i_links_count == num_links) {
+        return 0;
+    }
+    
+    report(REPORT_FIXED, "links_count", "inode [%d] links count was %d, "\
+           "but %d entries refer to it", inode_num, inode->i_links_count,
+           num_links);
+    
+    if (!dry_run) {
+        inode->i_links_count = num_links;
+    }
+    
+    return 1;
+}
+
+
+/*
+ * A block claimed more than once, and one of the inodes claiming it.
+ */
+struct dup_claim {
+    unsigned int block_num;
+    unsigned int inode_num;
+    int is_indirect;            // Whether it is the inode's indirect block
+};
+
+
+int compare_dup_claims(const void *a, const void *b) {
+    struct dup_claim *x = (struct dup_claim *) a;
+    struct dup_claim *y = (struct dup_claim *) b;
+    
+    if (x->block_num != y->block_num) {
+        return (x->block_num > y->block_num) - (x->block_num < y->block_num);
+    }
+    return (x->inode_num > y->inode_num) - (x->inode_num < y->inode_num);
+}
+
+
+/*
+ * Gives the inode its own copy of the given block, and points every
+ * pointer of the inode that referred to the block at the copy instead.
+ *
+ * Returns the number of the copy, or UNDEFINED if there is no free block.
+ */
+unsigned int clone_block(struct ext2_inode *inode, unsigned int block_num) {
+    
+    if (get_super_block()->s_free_blocks_count == 0) {
+        return UNDEFINED;
+    }
+    
+    unsigned int clone_num = allocate_block_near(block_num);
+    memcpy(BLOCK_START(disk, clone_num), BLOCK_START(disk, block_num),
+           EXT2_BLOCK_SIZE);
+    
+    int n;
+    for (n = 0; n < NUM_DIRECT_PTRS + NUM_INDIRECT_PTRS; n++) {
+        if (inode->i_block[n] == block_num) {
+            inode->i_block[n] = clone_num;
+        }
+    }
+    
+    unsigned int indirect_block_num = inode->i_block[NUM_DIRECT_PTRS];
+    
+    if (indirect_block_num == UNDEFINED ||
+        indirect_block_num >= get_blocks_count()) {
+        return clone_num;
+    }
+    
+    unsigned int *indirect_block = (unsigned int *)
+                                        BLOCK_START(disk, indirect_block_num);
+    
+    for (n = 0; n < NUM_PTRS_PER_BLOCK; n++) {
+        if (indirect_block[n] == block_num) {
+            indirect_block[n] = clone_num;
+        }
+    }
+    
+    return clone_num;
+}
+
+
+/*
+ * Reports every block claimed by more than one of the inodes marked in
+ * `reachable`, like pass 1B of e2fsck: the inodes are scanned a second
+ * time, looking only for the blocks in `dups`. If `clone` is set, every
+ * claimant but the lowest numbered inode is given its own copy of the block.
+ *
+ * Returns the total number of blocks cloned.
+ */
+int fix_dup_blocks(unsigned char *reachable, struct dup_blocks *dups,
+                   int clone) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned int inodes_count = get_inodes_count();
+    unsigned int blocks[MAX_INODE_BLOCKS];
+    
+    struct dup_claim *claims = NULL;
+    int num_claims = 0, max_claims = 0;
+    
+    unsigned int inode_num;
+    for (inode_num = NUM(0); inode_num <= inodes_count; inode_num++) {
+        
+        if (!reachable[INDEX(inode_num)]) {
+            continue;
+        }
+        
+        struct ext2_inode *inode = i_table + INDEX(inode_num);
+        int i, num_blocks = collect_inode_blocks(inode, blocks);
+        
+        inodes_visited++;
+        
+        for (i = 0; i < num_blocks; i++) {
+            if (!is_dup_block(dups, blocks[i])) {
+                continue;
+            }
+            
+            if (num_claims == max_claims) {
+                max_claims = max_claims ? 2 * max_claims : EXT2_BLOCK_SIZE;
+                claims = realloc(claims, max_claims * sizeof(*claims));
+                
+                if (claims == NULL) {
+                    exit(ENOMEM);
+                }
+            }
+            
+            claims[num_claims].block_num = blocks[i];
+            claims[num_claims].inode_num = inode_num;
+            claims[num_claims].is_indirect =
+                        (blocks[i] == inode->i_block[NUM_DIRECT_PTRS]);
+            num_claims++;
+        }
+    }
+    
+    qsort(claims, num_claims, sizeof(struct dup_claim), compare_dup_claims);
+    
+    // Room for a label per claim
+    char *owners = malloc(num_claims * MAX_OWNER_LABEL_LEN + 1);
+    
+    if (owners == NULL) {
+        exit(ENOMEM);
+    }
+    
+    int i, j;
+    for (i = 0; i < num_claims; i = j) {
+        int len = 0;
+        
+        for (j = i; j < num_claims &&
+                    claims[j].block_num == claims[i].block_num; j++) {
+            len += sprintf(owners + len, " [%d]", claims[j].inode_num);
+        }
+        
+        report(REPORT_WARNING, "duplicate_block", "data block [%d] is "\
+               "claimed by inodes%s", claims[i].block_num, owners);
+    }
+    
+    free(owners);
+    
+    // Indirect blocks are cloned first, so that the pointers to shared data
+    // blocks are only replaced in the copies
+    int num_cloned = 0, pass;
+    
+    for (pass = 0; clone && pass < 2; pass++) {
+        for (i = 0; i < num_claims; i++) {
+            
+            unsigned int block_num = claims[i].block_num;
+            unsigned int owner_num = claims[i].inode_num;
+            struct ext2_inode *inode = i_table + INDEX(owner_num);
+            
+            // The first claimant keeps the block, as does an inode that
+            // claims the same block twice
+            if ((pass == 0) != claims[i].is_indirect || i == 0 ||
+                claims[i - 1].block_num != block_num ||
+                claims[i - 1].inode_num == owner_num) {
+                continue;
+            }
+            
+            if (dry_run) {
+                report(REPORT_FIXED, "clone_block", "data block [%d] "\
+                       "cloned for inode [%d]", block_num, owner_num);
+                num_cloned++;
+                continue;
+            }
+            
+            unsigned int clone_num = clone_block(inode, block_num);
+            
+            if (clone_num == UNDEFINED) {
+                report(REPORT_WARNING, "clone_block", "no free block to "\
+                       "clone data block [%d] for inode [%d]", block_num,
+                       owner_num);
+                continue;
+            }
+            
+            report(REPORT_FIXED, "clone_block", "data block [%d] cloned to "\
+                   "block [%d] for inode [%d]", block_num, clone_num,
+                   owner_num);
+            num_cloned++;
+        }
+    }
+    
+    free(claims);
+    
+    return num_cloned;
+}
+
+
+/*
+ * Checks every inode marked in `reachable` for inconsistencies, and takes
+ * appropriate measures to fix them.
+ *
+ * The inode table is split into `num_threads` shards that are scanned in
+ * parallel, each building its own bitmap of claimed blocks, table of
+ * blocks claimed twice, and (unless `link_counts` has already been built)
+ * link count table. The tables are merged, and repairs are applied serially
+ * in inode order, so the output does not depend on the number of threads.
+ * Blocks claimed by several inodes are cloned if `clone` is set.
+ *
+ * Returns the total number of inconsistencies fixed.
+ */
+int fix_reachable_inodes(unsigned char *reachable,
+                         unsigned short *link_counts, int num_threads,
+                         int clone) {
+    
+    unsigned int inodes_count = get_inodes_count();
+    unsigned int blocks_count = get_blocks_count();
+    int num_fixed = 0;
+    
+    unsigned char *issues = calloc(inodes_count, sizeof(unsigned char));
+    struct check_shard *shards = calloc(num_threads,
+                                        sizeof(struct check_shard));
+    
+    if (issues == NULL || shards == NULL) {
+        exit(ENOMEM);
+    }
+    
+    prefetch_indirect_blocks(reachable);
+    
+    // Split the inode table into (nearly) equal shards
+    unsigned int shard_size = (inodes_count + num_threads - 1) / num_threads;
+    int t;
+    
+    for (t = 0; t < num_threads; t++) {
+        struct check_shard *shard = &shards[t];
+        
+        shard->first_inode_num = NUM(t * shard_size);
+        shard->end_inode_num = NUM((t + 1) * shard_size);
+        if (shard->end_inode_num > NUM(inodes_count)) {
+            shard->end_inode_num = NUM(inodes_count);
+        }
+        
+        shard->reachable = reachable;
+        shard->issues = issues;
+        shard->count_links = (link_counts == NULL);
+        shard->claimed = calloc(blocks_count / CHAR_BIT + 1,
+                                sizeof(unsigned char));
+        shard->link_counts = calloc(inodes_count, sizeof(unsigned short));
+        
+        if (shard->claimed == NULL || shard->link_counts == NULL) {
+            exit(ENOMEM);
+        }
+        
+        if (pthread_create(&shard->thread, NULL, scan_shard, shard) != 0) {
+            perror("pthread_create - Could not start checker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // Merge every shard's tables into the first one. A block claimed in
+    // two shards is a duplicate as well
+    unsigned char *claimed = shards[0].claimed;
+    struct dup_blocks *dups = &shards[0].dups;
+    
+    if (link_counts == NULL) {
+        link_counts = shards[0].link_counts;
+    }
+    
+    for (t = 0; t < num_threads; t++) {
+        pthread_join(shards[t].thread, NULL);
+        
+        bytes_scanned += shards[t].bytes_scanned;
+        inodes_visited += shards[t].inodes_visited;
+        
+        unsigned int i;
+        for (i = 0; t > 0 && i <= blocks_count / CHAR_BIT; i++) {
+            unsigned char overlap = claimed[i] & shards[t].claimed[i];
+            
+            int bit;
+            for (bit = 0; overlap && bit < CHAR_BIT; bit++) {
+                if (IS_IN_USE(overlap, bit)) {
+                    add_dup_block(dups, i * CHAR_BIT + bit);
+                }
+            }
+            claimed[i] |= shards[t].claimed[i];
+        }
+        for (i = 0; t > 0 && i < shards[t].dups.num; i++) {
+            add_dup_block(dups, shards[t].dups.block_nums[i]);
+        }
+        for (i = 0; t > 0 && shards[t].count_links && i < inodes_count; i++) {
+            link_counts[i] += shards[t].link_counts[i];
+        }
+    }
+    
+    unsigned int i;
+    for (i = 0; pending_links != NULL && i < inodes_count; i++) {
+        link_counts[i] += pending_links[i];
+    }
+    
+    // Apply repairs in inode order
+    unsigned int inode_num;
+    for (inode_num = NUM(0); inode_num <= inodes_count; inode_num++) {
+        
+        if (!reachable[INDEX(inode_num)]) {
+            continue;
+        }
+        
+        unsigned char inode_issues = issues[INDEX(inode_num)];
+        
+        if (inode_issues & ISSUE_NOT_IN_USE) {
+            num_fixed += fix_inode_allocation_inconsistency(inode_num);
+        }
+        if (inode_issues & ISSUE_DTIME) {
+            num_fixed += fix_inode_deletion_time(inode_num);
+        }
+        if (inode_issues & ISSUE_BLOCKS) {
+            num_fixed += fix_data_block_allocation(inode_num);
+        }
+        
+        // Links from outside the checked inodes are not counted
+        if (!incremental) {
+            num_fixed += fix_links_count(inode_num,
+                                         link_counts[INDEX(inode_num)]);
+        }
+    }
+    
+    // Blocks are only cloned once every referenced block is marked in-use
+    begin_phase("duplicates");
+    sort_dup_blocks(dups);
+    
+    if (dups->num > 0) {
+        num_fixed += fix_dup_blocks(reachable, dups, clone);
+    }
+    
+    for (t = 0; t < num_threads; t++) {
+        free(shards[t].claimed);
+        free(shards[t].dups.block_nums);
+        free(shards[t].link_counts);
+    }
+    free(shards);
+    free(issues);
+    
+    return num_fixed;
+}
+
+
+/*
+ * Pass 1 of the linear scan: streams the initialized part of the inode table
+ * in order, and collects the blocks of every directory that is in use
+ * (marked in the bitmap, or still linked), sorted by block number.
+ *
+ * Returns the number of blocks collected into `refs`.
+ */
+int collect_dir_blocks(struct dir_block_ref *refs) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned int inodes_count = get_initialized_inodes_count();
+    int num_refs = 0;
+    
+    unsigned int inode_num;
+    for (inode_num = NUM(0); inode_num <= inodes_count; inode_num++) {
+        struct ext2_inode *inode = i_table + INDEX(inode_num);
+        
+        if (IS_DIR(inode->i_mode) &&
+            (is_inode_in_use(inode_num) || inode->i_links_count > 0)) {
+            num_refs = add_dir_blocks(inode_num, refs, num_refs);
+        }
+    }
+    
+    qsort(refs, num_refs, sizeof(struct dir_block_ref),
+          compare_dir_block_refs);
+    
+    inodes_visited += inodes_count;
+    bytes_scanned += inodes_count * sizeof(struct ext2_inode);
+    
+    return num_refs;
+}
+
+
+/*
+ * Looks for an entry inside the directory with inode `dir_inode_num` that
+ * refers to the inode `inode_num`: its '..' entry if `parent` is set, or
+ * any other entry. Blocks out of range and blank entries end the search,
+ * as in count_dir_links().
+ *
+ * Returns the entry, or NULL if there is none.
+ */
+struct ext2_dir_entry *find_link_entry(unsigned int dir_inode_num,
+                                       unsigned int inode_num, int parent) {
+    
+    struct ext2_inode *dir_inode = get_inode_table() + INDEX(dir_inode_num);
+    unsigned int blocks_count = get_blocks_count();
+    
+    int n;
+    for (n = 0; n < NUM_DIRECT_PTRS && (dir_inode->i_block)[n] != 0; n++) {
+        
+        unsigned int block_num = (dir_inode->i_block)[n];
+        
+        if (block_num >= blocks_count) {
+            continue;
+        }
+        
+        unsigned char *block_start = BLOCK_START(disk, block_num);
+        unsigned char *block_end = BLOCK_END(block_start);
+        unsigned char *pos = block_start;
+        
+        while (pos < block_end) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *) pos;
+            
+            if (entry->rec_len == 0) {
+                break;
+            }
+            pos += entry->rec_len;
+            
+            if (entry->inode == UNDEFINED) {
+                continue;
+            }
+            
+            if (parent && entry->name_len == strlen(PARENT_DIR) &&
+                strncmp(entry->name, PARENT_DIR, entry->name_len) == 0) {
+                return entry;
+            }
+            if (!parent && entry->inode == inode_num &&
+                !is_self_or_parent_entry(entry)) {
+                return entry;
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+
+/*
+ * Returns TRUE if the given entry, inside the directory with inode
+ * `dir_inode_num`, is a second name for a directory: the directory's '..'
+ * refers to another directory, which has an entry for it as well. A
+ * directory with a single name is never cut off, even if its '..' is off.
+ */
+int is_second_dir_name(struct ext2_dir_entry *entry,
+                       unsigned int dir_inode_num) {
+    
+    struct ext2_inode *inode = get_inode_table() + INDEX(entry->inode);
+    
+    if (!IS_DIR(inode->i_mode) || is_self_or_parent_entry(entry)) {
+        return FALSE;
+    }
+    
+    struct ext2_dir_entry *parent_entry = find_link_entry(entry->inode,
+                                                          UNDEFINED, TRUE);
+    
+    if (parent_entry == NULL || parent_entry->inode == dir_inode_num ||
+        parent_entry->inode > get_inodes_count() ||
+        !IS_DIR(get_inode_table()[INDEX(parent_entry->inode)].i_mode)) {
+        return FALSE;
+    }
+    
+    return find_link_entry(parent_entry->inode, entry->inode, FALSE) != NULL;
+}
+
+
+/*
+ * Pass 2 of the linear scan: streams the given directory blocks in order
+ * of block number, counting the entries that refer to each inode. Every
+ * inode referred to by name (not just by "." or "..", so that orphaned
+ * directories stay unmarked) is marked in `reachable`, as is the root.
+ * Entries whose file_type does not match their inode are fixed, and so are
+ * second names for a directory (see is_second_dir_name).
+ *
+ * Returns the total number of inconsistencies fixed.
+ */
+int scan_dir_blocks(struct dir_block_ref *refs, int num_refs,
+                    unsigned char *reachable, unsigned short *link_counts) {
+    
+    unsigned int inodes_count = get_inodes_count();
+    int num_fixed = 0;
+    
+    reachable[EXT2_ROOT_INO_IDX] = TRUE;
+    bytes_scanned += (unsigned long long) num_refs * EXT2_BLOCK_SIZE;
+    
+    int i;
+    for (i = 0; i < num_refs; i++) {
+        
+        unsigned char *block_start = BLOCK_START(disk, refs[i].block_num);
+        unsigned char *block_end = BLOCK_END(block_start);
+        unsigned char *pos = block_start;
+        
+        while (pos < block_end) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *) pos;
+            
+            if (entry->rec_len == 0) {
+                break;
+            }
+            
+            if (entry->inode != UNDEFINED && entry->inode <= inodes_count) {
+                num_fixed += fix_file_type_mismatch(entry);
+                link_counts[INDEX(entry->inode)]++;
+                
+                if (is_second_dir_name(entry, refs[i].dir_inode_num)) {
+                    num_fixed += fix_dir_hard_link(entry,
+                                                   refs[i].dir_inode_num,
+                                                   link_counts);
+                }
+                else if (!is_self_or_parent_entry(entry)) {
+                    reachable[INDEX(entry->inode)] = TRUE;
+                }
+            }
+            
+            pos += entry->rec_len;
+        }
+    }
+    
+    return num_fixed;
+}
+
+
+/*
+ * Finds the /lost+found directory, creating it if it does not exist, and
+ * stores its inode number in `lost_found_num`. If `link_counts` is given,
+ * it is updated for the entries created. In a dry run, a missing
+ * /lost+found is only reported, and UNDEFINED is stored.
+ *
+ * Returns EXIT_SUCCESS, or ENOTDIR if there is a non-directory entry by
+ * that name.
+ */
+int get_lost_found_dir(unsigned char *reachable, unsigned short *link_counts,
+                       unsigned int *lost_found_num) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    struct ext2_inode *root_inode = i_table + EXT2_ROOT_INO_IDX;
+    unsigned int root_inode_num = NUM(EXT2_ROOT_INO_IDX);
+    
+    struct ext2_dir_entry *entry = find_entry(root_inode, LOST_FOUND_DIR);
+    
+    if (entry != NULL) {
+        *lost_found_num = entry->inode;
+        return (entry->file_type == EXT2_FT_DIR) ? EXIT_SUCCESS : ENOTDIR;
+    }
+    
+    if (dry_run) {
+        report(REPORT_FIXED, "lost_found", "/%s created for orphaned inodes",
+               LOST_FOUND_DIR);
+        *lost_found_num = UNDEFINED;
+        return EXIT_SUCCESS;
+    }
+    
+    entry = create_dir_entry(root_inode, UNDEFINED, LOST_FOUND_DIR,
+                             EXT2_FT_DIR);
+    get_group_descriptor()->bg_used_dirs_count++;
+    
+    *lost_found_num = entry->inode;
+    struct ext2_inode *lost_found = i_table + INDEX(*lost_found_num);
+    
+    create_dir_entry(lost_found, *lost_found_num, CURRENT_DIR, EXT2_FT_DIR);
+    create_dir_entry(lost_found, root_inode_num, PARENT_DIR, EXT2_FT_DIR);
+    
+    reachable[INDEX(*lost_found_num)] = TRUE;
+    
+    if (link_counts != NULL) {
+        link_counts[INDEX(*lost_found_num)] += 2;
+        link_counts[INDEX(root_inode_num)]++;
+    }
+    
+    printf("Created /%s for orphaned inodes\n", LOST_FOUND_DIR);
+    
+    return EXIT_SUCCESS;
+}
+
+
+/*
+ * Links the given orphaned inode into /lost+found as "#<inode number>".
+ * An orphaned directory's ".." entry is pointed at /lost+found, and the
+ * directories below it are marked reachable. The link counts are adjusted
+ * for the entries changed. In a dry run, nothing is changed on disk, and
+ * only the entry for the orphan itself is counted.
+ *
+ * Returns the total number of inconsistencies fixed.
+ */
+int reconnect_orphan(unsigned int inode_num, unsigned int lost_found_num,
+                     unsigned char *reachable, unsigned short *link_counts) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    struct ext2_inode *inode = i_table + INDEX(inode_num);
+    struct ext2_inode *lost_found = i_table + INDEX(lost_found_num);
+    
+    char name[MAX_ORPHAN_NAME_LEN];
+    snprintf(name, MAX_ORPHAN_NAME_LEN, "#%u", inode_num);
+    
+    // A dry run walks the orphan from an entry that only exists in memory
+    struct ext2_dir_entry orphan_entry;
+    struct ext2_dir_entry *entry = &orphan_entry;
+    
+    if (dry_run) {
+        memset(&orphan_entry, 0, sizeof(struct ext2_dir_entry));
+        orphan_entry.inode = inode_num;
+        orphan_entry.file_type = dir_entry_file_type(inode->i_mode);
+    }
+    else {
+        if (find_entry(lost_found, name) != NULL) {
+            report(REPORT_WARNING, "orphan_reconnected", "could not "\
+                   "reconnect orphaned inode [%d], /%s/%s exists",
+                   inode_num, LOST_FOUND_DIR, name);
+            return 0;
+        }
+        
+        // The entry created below is the only one left for a file. A
+        // directory keeps the links from "." and its subdirectories
+        if (IS_DIR(inode->i_mode)) {
+            inode->i_links_count -= (inode->i_links_count > 0);
+        }
+        else {
+            inode->i_links_count = 0;
+        }
+        
+        entry = create_dir_entry(lost_found, inode_num, name,
+                                 dir_entry_file_type(inode->i_mode));
+    }
+    
+    adjust_link_count(link_counts, inode_num, 1);
+    
+    report(REPORT_FIXED, "orphan_reconnected", "orphaned inode [%d] "\
+           "reconnected to /%s/%s", inode_num, LOST_FOUND_DIR, name);
+    
+    if (!IS_DIR(inode->i_mode)) {
+        reachable[INDEX(inode_num)] = TRUE;
+        return 1;
+    }
+    
+    // Moving ".." changes the link counts of both parents on disk and in
+    // the entries counted alike, so a dry run can leave it as it is
+    struct ext2_dir_entry *parent = find_entry(inode, PARENT_DIR);
+    
+    if (!dry_run && parent != NULL) {
+        unsigned int old_parent_num = parent->inode;
+        
+        if (old_parent_num != UNDEFINED &&
+            old_parent_num <= get_inodes_count()) {
+            struct ext2_inode *old_parent = i_table + INDEX(old_parent_num);
+            
+            old_parent->i_links_count -= (old_parent->i_links_count > 0);
+            adjust_link_count(link_counts, old_parent_num, -1);
+        }
+        
+        parent->inode = lost_found_num;
+        lost_found->i_links_count++;
+        adjust_link_count(link_counts, lost_found_num, 1);
+    }
+    
+    return 1 + mark_reachable_entries(entry, reachable);
+}
+
+
+/*
+ * Returns the topmost orphaned directory above the given orphaned
+ * directory, following ".." entries (at most once per inode, in case they
+ * form a cycle).
+ */
+unsigned int find_orphan_root(unsigned int inode_num,
+                              unsigned char *reachable) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned int inodes_count = get_inodes_count();
+    unsigned int first_ino = get_super_block()->s_first_ino;
+    
+    unsigned int steps;
+    for (steps = 0; steps < inodes_count; steps++) {
+        struct ext2_dir_entry *parent = find_entry(i_table + INDEX(inode_num),
+                                                   PARENT_DIR);
+        
+        if (parent == NULL || parent->inode < first_ino ||
+            parent->inode > inodes_count || parent->inode == inode_num) {
+            break;
+        }
+        
+        struct ext2_inode *parent_inode = i_table + INDEX(parent->inode);
+        
+        if (reachable[INDEX(parent->inode)] ||
+            !is_inode_in_use(parent->inode) ||
+            !IS_DIR(parent_inode->i_mode)) {
+            break;
+        }
+        
+        inode_num = parent->inode;
+    }
+    
+    return inode_num;
+}
+
+
+/*
+ * Finds the inodes that are marked in-use but not reachable. Orphans that
+ * still hold data are reconnected to /lost+found (directories first, from
+ * the topmost orphaned directory down, so that whole subtrees are kept
+ * together); the rest are freed. Reserved inodes are left alone.
+ *
+ * Returns the total number of inconsistencies fixed.
+ */
+int fix_orphan_inodes(unsigned char *reachable, unsigned short *link_counts) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned int inodes_count = get_inodes_count();
+    unsigned int first_ino = get_super_block()->s_first_ino;
+    unsigned int lost_found_num = UNDEFINED;
+    int found_lost_found = FALSE;
+    int num_fixed = 0, pass;
+    
+    // Directories in the first pass, everything else in the second
+    for (pass = 0; pass < 2; pass++) {
+        
+        unsigned int inode_num;
+        for (inode_num = first_ino; inode_num <= inodes_count; inode_num++) {
+            struct ext2_inode *inode = i_table + INDEX(inode_num);
+            
+            if (reachable[INDEX(inode_num)] || !is_inode_in_use(inode_num) ||
+                (pass == 0) != IS_DIR(inode->i_mode)) {
+                continue;
+            }
+            
+            inodes_visited++;
+            
+            // Nothing worth keeping, the blocks are freed as leaked blocks
+            if (inode->i_dtime != 0 || inode->i_size == 0) {
+                if (!dry_run) {
+                    if (IS_DIR(inode->i_mode)) {
+                        get_group_descriptor()->bg_used_dirs_count--;
+                    }
+                    inode->i_links_count = 0;
+                    inode->i_dtime = get_timestamp();
+                    free_inode(inode_num);
+                }
+                
+                report(REPORT_FIXED, "orphan_freed", "orphaned inode [%d] "\
+                       "freed", inode_num);
+                num_fixed++;
+                continue;
+            }
+            
+            if (!found_lost_found) {
+                found_lost_found = TRUE;
+                
+                if (get_lost_found_dir(reachable, link_counts,
+                                       &lost_found_num) != EXIT_SUCCESS) {
+                    report(REPORT_WARNING, "lost_found", "/%s is not a "\
+                           "directory, orphaned inodes are left alone",
+                           LOST_FOUND_DIR);
+                    return num_fixed;
+                }
+            }
+            
+            unsigned int orphan_num = (pass == 0) ?
+                            find_orphan_root(inode_num, reachable) : inode_num;
+            
+            num_fixed += reconnect_orphan(orphan_num, lost_found_num,
+                                          reachable, link_counts);
+        }
+    }
+    
+    return num_fixed;
+}
+
+
+/*
+ * Frees every block that is marked in-use, but is neither file system
+ * metadata nor claimed by a reachable (or reserved) inode. The blocks are
+ * freed together in one batch.
+ *
+ * Returns the total number of inconsistencies fixed.
+ */
+int fix_leaked_blocks(unsigned char *reachable) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned int inodes_count = get_inodes_count();
+    unsigned int blocks_count = get_blocks_count();
+    unsigned int first_ino = get_super_block()->s_first_ino;
+    
+    unsigned char *claimed = calloc(blocks_count / CHAR_BIT + 1,
+                                    sizeof(unsigned char));
+    unsigned int blocks[MAX_INODE_BLOCKS];
+    
+    if (claimed == NULL) {
+        exit(ENOMEM);
+    }
+    
+    unsigned int inode_num;
+    for (inode_num = NUM(0); inode_num <= inodes_count; inode_num++) {
+        
+        if (!reachable[INDEX(inode_num)] &&
+            (inode_num >= first_ino || !is_inode_in_use(inode_num))) {
+            continue;
+        }
+        
+        int i, num_blocks = collect_inode_blocks(i_table + INDEX(inode_num),
+                                                 blocks);
+        
+        for (i = 0; i < num_blocks; i++) {
+            claimed[blocks[i] / CHAR_BIT] |= (1 << (blocks[i] % CHAR_BIT));
+        }
+        inodes_visited++;
+    }
+    
+    // Everything up to the end of the inode table is metadata
+    unsigned int metadata_end = get_group_descriptor()->bg_inode_table +
+                    (inodes_count * sizeof(struct ext2_inode) +
+                     EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    int num_leaked = 0;
+    
+    if (!dry_run) {
+        begin_block_free_batch();
+    }
+    
+    unsigned int block_num;
+    for (block_num = metadata_end; block_num < blocks_count; block_num++) {
+        if (is_block_in_use(block_num) &&
+            !IS_IN_USE(claimed[block_num / CHAR_BIT], block_num % CHAR_BIT)) {
+            if (!dry_run) {
+                free_block(block_num);
+            }
+            num_leaked++;
+        }
+    }
+    
+    if (!dry_run) {
+        end_block_free_batch();
+    }
+    free(claimed);
+    
+    bytes_scanned += blocks_count / CHAR_BIT;
+    
+    if (num_leaked > 0) {
+        report(REPORT_FIXED, "leaked_blocks", "%d leaked blocks freed",
+               num_leaked);
+    }
+    
+    return num_leaked;
+}
+
+
+/*
+ * Checks the inodes marked in `reachable`: orphaned inodes are reconnected
+ * or freed first, the reachable inodes are then checked, and the blocks no
+ * inode refers to are freed last.
+ *
+ * Returns the total number of inconsistencies fixed.
+ */
+int fix_marked_inodes(unsigned char *reachable, unsigned short *link_counts,
+                      int num_threads, int clone) {
+    
+    begin_phase("orphans");
+    int num_fixed = fix_orphan_inodes(reachable, link_counts);
+    
+    begin_phase("inodes");
+    num_fixed += fix_reachable_inodes(reachable, link_counts, num_threads,
+                                      clone);
+    
+    begin_phase("leaks");
+    num_fixed += fix_leaked_blocks(reachable);
+    
+    return num_fixed;
+}
+
+
+/*
+ * Checks every inode that is referred to by some directory in use, finding
+ * them with two sequential passes (over the inode table, and then over the
+ * directory blocks in order of block number) rather than by walking the
+ * directory tree.
+ *
+ * Returns the total number of inconsistencies fixed.
+ */
+int fix_inodes_linearly(int num_threads, int clone) {
+    
+    unsigned int inodes_count = get_inodes_count();
+    
+    unsigned char *reachable = calloc(inodes_count, sizeof(unsigned char));
+    unsigned short *link_counts = calloc(inodes_count,
+                                         sizeof(unsigned short));
+    struct dir_block_ref *refs = malloc(inodes_count * NUM_DIRECT_PTRS *
+                                        sizeof(struct dir_block_ref));
+    
+    if (reachable == NULL || link_counts == NULL || refs == NULL) {
+        exit(ENOMEM);
+    }
+    
+    begin_phase("inode_table");
+    int num_refs = collect_dir_blocks(refs);
+    
+    begin_phase("directory_blocks");
+    prefetch_dir_blocks(refs, num_refs);
+    int num_fixed = scan_dir_blocks(refs, num_refs, reachable, link_counts);
+    
+    num_fixed += fix_marked_inodes(reachable, link_counts, num_threads, clone);
+    
+    free(refs);
+    free(link_counts);
+    free(reachable);
+    
+    return num_fixed;
+}
+
+
+/*
+ * Checks every inode reachable from the root directory, found by walking
+ * the directory tree.
+ *
+ * Returns the total number of inconsistencies fixed.
+ */
+int fix_inodes_from_root(struct ext2_dir_entry *root_entry, int num_threads,
+                         int clone) {
+    
+    unsigned char *reachable = calloc(get_inodes_count(),
+                                      sizeof(unsigned char));
+    
+    if (reachable == NULL) {
+        exit(ENOMEM);
+    }
+    
+    begin_phase("directory_walk");
+    int num_fixed = mark_reachable_entries(root_entry, reachable);
+    
+    num_fixed += fix_marked_inodes(reachable, NULL, num_threads, clone);
+    
+    free(reachable);
+    
+    return num_fixed;
+}
+
+
+/*
+ * Checks only the inodes in the dirty log of the image, which the tools
+ * append to as they modify it, along with every inode that the entries of
+ * the dirty directories refer to.
+ *
+ * Link counts, orphans and leaked blocks can not be judged from part of
+ * the tree, so they are left to a full check, and the dirty log is kept
+ * until one has run.
+ *
+ * Returns the total number of inconsistencies fixed.
+ */
+int fix_inodes_incrementally(char *disk_image_path, int num_threads,
+                             int clone) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned int inodes_count = get_inodes_count();
+    
+    unsigned char *dirty = calloc(inodes_count, sizeof(unsigned char));
+    unsigned char *reachable = calloc(inodes_count, sizeof(unsigned char));
+    unsigned short *link_counts = calloc(inodes_count,
+                                         sizeof(unsigned short));
+    struct dir_block_ref *refs = malloc(inodes_count * NUM_DIRECT_PTRS *
+                                        sizeof(struct dir_block_ref));
+    
+    if (dirty == NULL || reachable == NULL || link_counts == NULL ||
+        refs == NULL) {
+        exit(ENOMEM);
+    }
+    
+    begin_phase("dirty_inodes");
+    int num_dirty = read_dirty_log(disk_image_path, dirty);
+    int num_refs = 0;
+    
+    unsigned int inode_num;
+    for (inode_num = NUM(0); num_dirty > 0 && inode_num <= inodes_count;
+         inode_num++) {
+        
+        struct ext2_inode *inode = i_table + INDEX(inode_num);
+        
+        // Inodes deleted since are only accounted for by the counters
+        if (!dirty[INDEX(inode_num)] ||
+            (!is_inode_in_use(inode_num) && inode->i_links_count == 0)) {
+            continue;
+        }
+        
+        reachable[INDEX(inode_num)] = TRUE;
+        
+        if (IS_DIR(inode->i_mode)) {
+            num_refs = add_dir_blocks(inode_num, refs, num_refs);
+        }
+    }
+    
+    inodes_visited += num_dirty;
+    bytes_scanned += num_dirty * sizeof(struct ext2_inode);
+    
+    // Follow the entries of the dirty directories to the inodes they name
+    qsort(refs, num_refs, sizeof(struct dir_block_ref),
+          compare_dir_block_refs);
+    prefetch_dir_blocks(refs, num_refs);
+    
+    int num_fixed = scan_dir_blocks(refs, num_refs, reachable, link_counts);
+    
+    begin_phase("inodes");
+    num_fixed += fix_reachable_inodes(reachable, link_counts, num_threads,
+                                      clone);
+    
+    free(refs);
+    free(link_counts);
+    free(reachable);
+    free(dirty);
+    
+    return num_fixed;
+}
+
+
+/*
+ * Detects a small subset of possible file system inconsistencies and takes
+ * appropriate actions to fix them. If `linear` is set, the inode table and
+ * directory blocks are scanned sequentially instead of walking the tree.
+ * In incremental mode, only the inodes in the dirty log are checked.
+ * If `clone` is set, blocks claimed by several inodes are cloned. In a dry
+ * run, the inconsistencies are only reported.
+ *
+ * Returns the total number of inconsistencies fixed.
+ */
+unsigned int fix_inconsistencies(char *disk_image_path, int num_threads,
+                                 int linear, int clone) {
+    int num_fixed = 0;
+    struct ext2_inode *root_dir_inode = get_inode_table() + EXT2_ROOT_INO_IDX;
+    
+    // Root inode MUST have a type of 'directory'
+    // Fix it, if it doesn't
+    if (!IS_DIR(root_dir_inode->i_mode)) {
+        if (!dry_run) {
+            root_dir_inode->i_mode |= EXT2_S_IFDIR;
+        }
+        num_fixed++;
+        report(REPORT_FIXED, "root_not_dir", "Root inode not marked as "\
+               "directory");
+    }
+    
+    struct ext2_dir_entry *root_entry = (struct ext2_dir_entry *)
+                                BLOCK_START(disk, root_dir_inode->i_block[0]);
+    
+    begin_phase("counters");
+    num_fixed += fix_initialized_inodes_count();
+    
+    // Every mode reads (parts of) the inode table, so start reading all of
+    // its initialized part in now, while the bitmaps are scanned
+    unsigned int i_table_size = get_initialized_inodes_count() *
+                                sizeof(struct ext2_inode);
+    advise_blocks(get_group_descriptor()->bg_inode_table,
+                  (i_table_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE,
+                  MADV_WILLNEED);
+    
+    num_fixed += fix_free_inodes_count();
+    num_fixed += fix_free_blocks_count();
+    
+    if (incremental) {
+        num_fixed += fix_inodes_incrementally(disk_image_path, num_threads,
+                                              clone);
+    }
+    else if (linear) {
+        num_fixed += fix_inodes_linearly(num_threads, clone);
+    }
+    else {
+        num_fixed += fix_inodes_from_root(root_entry, num_threads, clone);
+    }
+    
+    return num_fixed;
+}
+
+
+/*
+ * Prints the given string as a JSON string literal.
+ */
+void print_json_string(char *str) {
+    
+    putchar('"');
+    
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            printf("\\%c", *str);
+        }
+        else if ((unsigned char) *str < ' ') {
+            printf("\\u%04x", *str);
+        }
+        else {
+            putchar(*str);
+        }
+    }
+    
+    putchar('"');
+}
+
+
+/*
+ * Prints the report of a dry run as JSON: the issues found, and the time
+ * taken and work done by each phase of the check.
+ */
+void print_json_report(char *disk_image_path, int linear, int num_threads,
+                       unsigned int num_fixed) {
+    
+    printf("{\n  \"image\": ");
+    print_json_string(disk_image_path);
+    printf(",\n  \"dry_run\": true,\n");
+    printf("  \"mode\": \"%s\",\n",
+           incremental ? "incremental" : (linear ? "linear" : "walk"));
+    printf("  \"threads\": %d,\n", num_threads);
+    printf("  \"inconsistencies\": %u,\n", num_fixed);
+    printf("  \"issues\": [");
+    
+    int i;
+    for (i = 0; i < num_report_entries; i++) {
+        struct report_entry *entry = &report_entries[i];
+        
+        printf("%s\n    {\"severity\": \"%s\", \"type\": \"%s\", "\
+               "\"message\": ", (i > 0) ? "," : "",
+               (entry->severity == REPORT_FIXED) ? "fix" : "warning",
+               entry->type);
+        print_json_string(entry->message);
+        printf("}");
+    }
+    
+    printf("%s],\n  \"phases\": [", (num_report_entries > 0) ? "\n  " : "");
+    
+    double total_seconds = 0;
+    
+    for (i = 0; i < num_phases; i++) {
+        struct check_phase *phase = &phases[i];
+        
+        printf("%s\n    {\"name\": \"%s\", \"seconds\": %.6f, "\
+               "\"bytes_scanned\": %llu, \"inodes_visited\": %llu}",
+               (i > 0) ? "," : "", phase->name, phase->seconds,
+               phase->bytes_scanned, phase->inodes_visited);
+        total_seconds += phase->seconds;
+    }
+    
+    printf("\n  ],\n  \"total\": {\"seconds\": %.6f, "\
+           "\"bytes_scanned\": %llu, \"inodes_visited\": %llu}\n}\n",
+           total_seconds, bytes_scanned, inodes_visited);
+}
+
+
+int main(int argc, char *argv[]) {
+    
+    if (argc < MIN_ARGUMENT_V) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    char *disk_image_path = argv[1];
+    int linear = FALSE;
+    int clone = FALSE;
+    
+    // Use one thread per online CPU, unless told otherwise
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    int i;
+    for (i = 2; i < argc; i++) {
+        if (strcmp(argv[i], LINEAR_FLAG) == 0) {
+            linear = TRUE;
+        }
+        else if (strcmp(argv[i], CLONE_FLAG) == 0) {
+            clone = TRUE;
+        }
+        else if (strcmp(argv[i], DRY_RUN_FLAG) == 0) {
+            dry_run = TRUE;
+        }
+        else if (strcmp(argv[i], INCREMENTAL_FLAG) == 0) {
+            incremental = TRUE;
+        }
+        else if (strcmp(argv[i], THREADS_FLAG) == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        }
+        else {
+            fprintf(stderr, USAGE, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    // A dry run must not be able to modify the image
+    disk = dry_run ? read_disk_image_readonly(disk_image_path) :
+                     read_disk_image(disk_image_path);
+    
+    // Every thread needs at least one inode to scan
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (num_threads > get_inodes_count()) {
+        num_threads = get_inodes_count();
+    }
+    
+    unsigned int num_fixed = fix_inconsistencies(disk_image_path, num_threads,
+                                                 linear, clone);
+    end_phase();
+    
+    // Every change logged so far has now been checked, unless the check
+    // was incremental and left link counts, orphans and leaked blocks to a
+    // full check
+    if (!dry_run && !incremental) {
+        clear_dirty_log();
+    }
+    
+    if (dry_run) {
+        print_json_report(disk_image_path, linear, num_threads, num_fixed);
+    }
+    else if (num_fixed) {
         printf("%d file system inconsistencies repaired!\n", num_fixed);
     }
     else {
@@ -8,10 +8,21 @@
 
 #include "ext2_utils.h"
 
-#define USAGE "Usage: %s <image file name> <file on native OS> "\
-                        "<path on ext2 image>\n"
+#define USAGE "Usage: %s <image file name> [--dedup | --overwrite | --append] "\
+                        "<file on native OS> <path on ext2 image>\n"
 
-#define NUM_ARGUMENT_V 4
+#define DEDUP_FLAG "--dedup"
+#define OVERWRITE_FLAG "--overwrite"
+#define APPEND_FLAG "--append"
+
+// How the source file is copied onto the image
+#define COPY_NEW 0        // Fail if the target already exists
+#define COPY_DEDUP 1      // Hard link to an identical file, if there is one
+#define COPY_OVERWRITE 2  // Replace the target's data in place
+#define COPY_APPEND 3     // Add to the end of the target's data
+
+#define MIN_ARGUMENT_V 4
+#define MAX_ARGUMENT_V 5
 #define READ_BINARY "rb"
 
 unsigned char *disk = NULL;
@@ -49,11 +60,18 @@ FILE *open_file(char *path) {
 }
 
 /*
- * Creates a file by the given name at the given path.
+ * Creates a file by the given name at the given path. The new entry is
+ * linked to `link_inode`, or to a newly allocated inode if it is UNDEFINED.
  *
- * Returns the directory entry for the newly created file, if it was created.
+ * If `mode` is COPY_OVERWRITE or COPY_APPEND and a regular file already
+ * exists at the target, its directory entry is returned instead.
+ *
+ * Returns the directory entry for the target file.
  */
-struct ext2_dir_entry *create_target_file(char *path, char *name) {
+struct ext2_dir_entry *create_target_file(char *path, char *name,
+                                          unsigned int link_inode, int mode) {
+    
+    int reuse_existing = (mode == COPY_OVERWRITE || mode == COPY_APPEND);
     
     // Ensure that file_path starts with a '/'
     if (!IS_PATH_ABSOLUTE(path)) {
@@ -90,6 +108,13 @@ struct ext2_dir_entry *create_target_file(char *path, char *name) {
             if (strlen(rem_path) != 0) {
                 exit(ENOENT);
             }
+            
+            // Update the existing file in place
+            if (reuse_existing &&
+                curr_dir_entry->file_type == EXT2_FT_REG_FILE) {
+                return curr_dir_entry;
+            }
+            
             // A file or link already exists by this name
             exit(EEXIST);
         }
@@ -110,96 +135,316 @@ struct ext2_dir_entry *create_target_file(char *path, char *name) {
     if (token != NULL)
         name = token;
     
-    return create_dir_entry(curr_inode, UNDEFINED, name, EXT2_FT_REG_FILE);
+    // Update the existing file by this name inside the target directory
+    struct ext2_dir_entry *existing = find_entry(curr_inode, name);
+    
+    if (reuse_existing && existing != NULL &&
+        existing->file_type == EXT2_FT_REG_FILE) {
+        return existing;
+    }
+    
+    return create_dir_entry(curr_inode, link_inode, name, EXT2_FT_REG_FILE);
 }
 
 
 /*
- * Copies data from the given file into the given inode.
+ * Writes the contents of the given file into the given inode, starting at
+ * byte `*offset`, which is moved right past the last byte written. Data
+ * blocks the inode already has are reused in place, and new ones are
+ * allocated contiguous to the previous block of the file.
+ *
+ * Returns EXIT_SUCCESS, if the whole file was written.
+ *                EFBIG, if the rest of the file does not fit past the
+ *                       largest supported file size.
  */
-void copy_data(struct ext2_inode *inode, FILE *src) {
+int write_data(struct ext2_inode *inode, FILE *src, unsigned int *offset) {
     
     unsigned int bytes_read;
+    int result = EXIT_SUCCESS;
     unsigned char buf[EXT2_BLOCK_SIZE];
     
-    int block_ptr_index = 0;
+    int n = *offset / EXT2_BLOCK_SIZE;             // Current block in file
+    unsigned int block_offset = *offset % EXT2_BLOCK_SIZE;
     
-    // Write data to the direct blocks
-    while (block_ptr_index < NUM_DIRECT_PTRS &&
-           (bytes_read = fread(buf, 1, EXT2_BLOCK_SIZE, src)) > 0) {
+    // Try to place new blocks right after the preceding block of the file
+    unsigned int goal = UNDEFINED;
+    if (n > 0 && get_data_block_num(inode, n - 1) != UNDEFINED) {
+        goal = get_data_block_num(inode, n - 1) + 1;
+    }
+    
+    while ((bytes_read = fread(buf, 1, EXT2_BLOCK_SIZE - block_offset,
+                               src)) > 0) {
         
-        // Allocate block
-        unsigned int block_num = allocate_block();
-        inode->i_block[block_ptr_index++] = block_num;
-        inode->i_blocks = NUM_DISK_BLKS(inode->i_blocks, EXT2_BLOCK_SIZE);
+        unsigned int block_num = map_data_block(inode, n, goal);
+        
+        // Reached the largest supported file size
+        if (block_num == UNDEFINED) {
+            result = EFBIG;
+            break;
+        }
         
         // Copy data into block
-        unsigned char *block = disk + (block_num * EXT2_BLOCK_SIZE);
-        memcpy(block, buf, bytes_read);
+        unsigned char *block = BLOCK_START(disk, block_num);
+        memcpy(block + block_offset, buf, bytes_read);
         
-        inode->i_size += bytes_read;
+        *offset += bytes_read;
+        block_offset = 0;
+        goal = block_num + 1;
+        n++;
+    }
+    
+    if (*offset > inode->i_size) {
+        inode->i_size = *offset;
+    }
+    
+    inode->i_mtime = get_timestamp();
+    mark_inode_dirty(NUM(inode - get_inode_table()));
+    
+    return result;
+}
+
+
+/*
+ * Replaces the data of the given inode with the contents of the given file.
+ * Only the blocks past the new end of file are freed.
+ *
+ * Note: Like cp(1), this updates every hard link to the inode.
+ *
+ * Returns EXIT_SUCCESS, or EFBIG if the file does not fit (see write_data).
+ */
+int overwrite_data(struct ext2_inode *inode, FILE *src) {
+    
+    unsigned int size = 0;
+    int result = write_data(inode, src, &size);
+    
+    // Release the surplus blocks of the old (longer) data
+    truncate_inode(inode, size);
+    
+    return result;
+}
+
+
+/*
+ * An entry in the index of files that may share their data with the
+ * source file.
+ */
+struct dedup_candidate {
+    struct content_hash hash;
+    unsigned int inode_num;
+};
+
+
+int compare_dedup_candidates(const void *a, const void *b) {
+    struct dedup_candidate *x = (struct dedup_candidate *) a;
+    struct dedup_candidate *y = (struct dedup_candidate *) b;
+    
+    int order = compare_content_hash(&x->hash, &y->hash);
+    
+    if (order == 0) {
+        order = (x->inode_num > y->inode_num) - (x->inode_num < y->inode_num);
     }
     
-    // Return if all data have been written to the file
-    if ((bytes_read = fread(buf, 1, EXT2_BLOCK_SIZE, src)) <= 0) {
-        return;
+    return order;
+}
+
+
+/*
+ * Computes the hash and size of the given file, and rewinds it.
+ */
+void hash_file(FILE *file, struct content_hash *hash, unsigned int *size) {
+    
+    unsigned int bytes_read;
+    unsigned char buf[EXT2_BLOCK_SIZE];
+    
+    init_content_hash(hash);
+    *size = 0;
+    
+    while ((bytes_read = fread(buf, 1, EXT2_BLOCK_SIZE, file)) > 0) {
+        update_content_hash(hash, buf, bytes_read);
+        *size += bytes_read;
+    }
+    
+    rewind(file);
+}
+
+
+/*
+ * Returns TRUE if the data stored in the given inode is byte-identical to
+ * the contents of the given file. The file is rewound afterwards.
+ */
+int is_same_data(struct ext2_inode *inode, FILE *file) {
+    
+    unsigned int bytes_read;
+    unsigned char buf[EXT2_BLOCK_SIZE];
+    
+    int same = TRUE;
+    int n;
+    
+    for (n = 0; same && (bytes_read = fread(buf, 1, EXT2_BLOCK_SIZE, file)) > 0;
+         n++) {
+        
+        unsigned int block_num = get_data_block_num(inode, n);
+        
+        same = (block_num != UNDEFINED &&
+                memcmp(BLOCK_START(disk, block_num), buf, bytes_read) == 0);
     }
     
-    // Allocate indirect block and write remaining data
-    unsigned int indirect_block_num = allocate_block();
-    inode->i_block[block_ptr_index++] = indirect_block_num;
-    inode->i_blocks = NUM_DISK_BLKS(inode->i_blocks, EXT2_BLOCK_SIZE);
+    rewind(file);
     
-    // Current and starting position in indirect block
-    unsigned int *indirect_block = (unsigned int *)
-                                     BLOCK_START(disk, indirect_block_num);
+    return same;
+}
+
+
+/*
+ * Builds an index (sorted by hash) of all regular files on the image that
+ * are `size` bytes long, since only those can be identical to the source.
+ *
+ * Returns the number of entries written into `index`.
+ */
+int build_dedup_index(unsigned int size, struct dedup_candidate *index) {
     
-    int max_indirect_blocks = EXT2_BLOCK_SIZE / sizeof(unsigned int);
-    int num_indirect_blocks = 0;
+    struct ext2_inode *i_table = get_inode_table();
+    int inodes_count = get_inodes_count();
+    int num_candidates = 0;
     
-    do {
-        // Allocate direct block
-        unsigned int direct_block_num = allocate_block();
-        *(indirect_block++) = direct_block_num;
-        inode->i_blocks = NUM_DISK_BLKS(inode->i_blocks, EXT2_BLOCK_SIZE);
+    int i;
+    for (i = 0; i < inodes_count; i++) {
+        struct ext2_inode *inode = i_table + i;
         
-        // Copy data into block
-        unsigned char *block = BLOCK_START(disk, direct_block_num);
-        memcpy(block, buf, bytes_read);
+        if (!is_inode_in_use(NUM(i)) || !IS_REG_FILE(inode->i_mode) ||
+            inode->i_links_count == 0 || inode->i_size != size) {
+            continue;
+        }
         
-        inode->i_size += bytes_read;
+        hash_inode_data(inode, &index[num_candidates].hash);
+        index[num_candidates].inode_num = NUM(i);
+        num_candidates++;
+    }
+    
+    qsort(index, num_candidates, sizeof(struct dedup_candidate),
+          compare_dedup_candidates);
+    
+    return num_candidates;
+}
+
+
+/*
+ * Looks for a regular file on the image whose contents are identical to
+ * the given file.
+ *
+ * Returns the number of the matching inode, or UNDEFINED if there is none.
+ */
+unsigned int find_duplicate_inode(FILE *src) {
+    
+    struct dedup_candidate key;
+    unsigned int size;
+    
+    hash_file(src, &key.hash, &size);
+    key.inode_num = UNDEFINED;
+    
+    struct dedup_candidate *index = malloc(get_inodes_count() *
+                                           sizeof(struct dedup_candidate));
+    
+    if (index == NULL) {
+        exit(ENOMEM);
+    }
+    
+    int num_candidates = build_dedup_index(size, index);
+    unsigned int match = UNDEFINED;
+    
+    // Skip to the first candidate with a matching hash
+    int i = 0;
+    while (i < num_candidates &&
+           compare_content_hash(&index[i].hash, &key.hash) < 0) {
+        i++;
+    }
+    
+    // Confirm the match byte by byte, in case of a hash collision
+    for (; i < num_candidates &&
+           compare_content_hash(&index[i].hash, &key.hash) == 0; i++) {
         
-        num_indirect_blocks++;
+        struct ext2_inode *inode = get_inode_table() +
+                                   INDEX(index[i].inode_num);
         
-    } while (num_indirect_blocks < max_indirect_blocks &&
-             (bytes_read = fread(buf, 1, EXT2_BLOCK_SIZE, src)) > 0);
+        if (is_same_data(inode, src)) {
+            match = index[i].inode_num;
+            break;
+        }
+    }
+    
+    free(index);
+    
+    return match;
 }
 
 
 int main(int argc, char *argv[]) {
     
-    if (argc != NUM_ARGUMENT_V) {
+    if (argc < MIN_ARGUMENT_V || argc > MAX_ARGUMENT_V) {
         fprintf(stderr, USAGE, argv[0]);
         return EXIT_FAILURE;
     }
     
+    int mode = COPY_NEW;
     char *disk_image_path = argv[1];
-    char *src_path = argv[2];
-    char *target_path = argv[3];
+    char *src_path;
+    char *target_path;
+    
+    // Check if a flag for the copy mode is present
+    if (argc == MAX_ARGUMENT_V) {
+        char *flag = argv[2];
+        
+        if (strcmp(flag, DEDUP_FLAG) == 0) {
+            mode = COPY_DEDUP;
+        }
+        else if (strcmp(flag, OVERWRITE_FLAG) == 0) {
+            mode = COPY_OVERWRITE;
+        }
+        else if (strcmp(flag, APPEND_FLAG) == 0) {
+            mode = COPY_APPEND;
+        }
+        else {
+            fprintf(stderr, USAGE, argv[0]);
+            return EXIT_FAILURE;
+        }
+        src_path = argv[3];
+        target_path = argv[4];
+    }
+    else {
+        src_path = argv[2];
+        target_path = argv[3];
+    }
     
     disk = read_disk_image(disk_image_path);
     
     FILE *src_file = open_file(src_path);
     char *src_name = get_file_name(src_path);
     
-    // Create target file
-    struct ext2_dir_entry *target = create_target_file(target_path, src_name);
+    // Share the data of an identical file, if there is one
+    unsigned int link_inode = (mode == COPY_DEDUP) ?
+                                find_duplicate_inode(src_file) : UNDEFINED;
+    
+    // Create target file (or find the existing one)
+    struct ext2_dir_entry *target = create_target_file(target_path, src_name,
+                                                       link_inode, mode);
     struct ext2_inode *inode = get_inode_table() + INDEX(target->inode);
     
-    // Copy data into target file
-    copy_data(inode, src_file);
+    // Copy data into target file, unless it is a hard link to an existing one
+    int result = EXIT_SUCCESS;
+    unsigned int offset = 0;
+    
+    if (mode == COPY_APPEND) {
+        offset = inode->i_size;
+        result = write_data(inode, src_file, &offset);
+    }
+    else if (mode == COPY_OVERWRITE) {
+        result = overwrite_data(inode, src_file);
+    }
+    else if (link_inode == UNDEFINED) {
+        result = write_data(inode, src_file, &offset);
+    }
     
     fclose(src_file);
     
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return result;
+}
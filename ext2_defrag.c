@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "ext2_utils.h"
+
+
+#define USAGE "Usage: %s <image file name> [-n]\n"
+
+#define DRY_RUN_FLAG "-n"
+
+#define MIN_ARGUMENT_V 2
+#define MAX_ARGUMENT_V 3
+
+unsigned char *disk = NULL;
+
+
+/*
+ * A file whose blocks are not contiguous on the disk.
+ */
+struct fragmented_file {
+    unsigned int inode_num;
+    int num_runs;             // Runs of consecutive blocks
+};
+
+/*
+ * How fragmented the files on the disk are.
+ */
+struct fragmentation_score {
+    unsigned int num_files;       // Files with at least one block
+    unsigned int num_fragmented;  // Files with more than one run of blocks
+    unsigned int num_runs;        // Runs of consecutive blocks, in all files
+};
+
+
+/*
+ * Returns the number of runs of consecutive blocks in `blocks`.
+ */
+int count_runs(unsigned int *blocks, int num_blocks) {
+    
+    int num_runs = (num_blocks > 0) ? 1 : 0;
+    
+    int i;
+    for (i = 1; i < num_blocks; i++) {
+        if (blocks[i] != blocks[i - 1] + 1) {
+            num_runs++;
+        }
+    }
+    
+    return num_runs;
+}
+
+
+/*
+ * Returns the number of block pointers in the given inode, counting those
+ * that are out of range.
+ */
+int count_block_ptrs(struct ext2_inode *inode) {
+    
+    int n, num_ptrs = 0;
+    for (n = 0; n < NUM_DIRECT_PTRS + NUM_INDIRECT_PTRS; n++) {
+        if (inode->i_block[n] != UNDEFINED) {
+            num_ptrs++;
+        }
+    }
+    
+    unsigned int indirect_block_num = inode->i_block[NUM_DIRECT_PTRS];
+    
+    if (indirect_block_num == UNDEFINED ||
+        indirect_block_num >= get_blocks_count()) {
+        return num_ptrs;
+    }
+    
+    unsigned int *indirect_block = (unsigned int *)
+                                        BLOCK_START(disk, indirect_block_num);
+    
+    for (n = 0; n < NUM_PTRS_PER_BLOCK; n++) {
+        if (indirect_block[n] != UNDEFINED) {
+            num_ptrs++;
+        }
+    }
+    
+    return num_ptrs;
+}
+
+
+/*
+ * Returns TRUE if the blocks of the given inode can be moved: it is a file,
+ * directory or (slow) symbolic link in use, and all of its block pointers
+ * are in range. Inodes with bad pointers are left for ext2_checker.
+ */
+int is_movable(unsigned int inode_num, struct ext2_inode *inode) {
+    
+    struct ext2_super_block *sb = get_super_block();
+    unsigned int blocks[MAX_INODE_BLOCKS];
+    
+    if (!is_inode_in_use(inode_num) ||
+        (inode_num != NUM(EXT2_ROOT_INO_IDX) && inode_num < sb->s_first_ino)) {
+        return FALSE;
+    }
+    
+    if (!IS_REG_FILE(inode->i_mode) && !IS_DIR(inode->i_mode) &&
+        !(IS_SYMLINK(inode->i_mode) && inode->i_blocks > 0)) {
+        return FALSE;
+    }
+    
+    return collect_inode_blocks(inode, blocks) == count_block_ptrs(inode);
+}
+
+
+/*
+ * Measures how fragmented the files on the disk are, and collects the
+ * files that are fragmented into `files` (if not NULL).
+ *
+ * Returns the number of fragmented files.
+ */
+int measure_fragmentation(struct fragmented_file *files,
+                          struct fragmentation_score *score) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned int inodes_count = get_initialized_inodes_count();
+    unsigned int blocks[MAX_INODE_BLOCKS];
+    
+    score->num_files = 0;
+    score->num_fragmented = 0;
+    score->num_runs = 0;
+    
+    unsigned int inode_num;
+    for (inode_num = NUM(0); inode_num <= inodes_count; inode_num++) {
+        struct ext2_inode *inode = i_table + INDEX(inode_num);
+        
+        if (!is_movable(inode_num, inode)) {
+            continue;
+        }
+        
+        int num_blocks = collect_inode_blocks(inode, blocks);
+        int num_runs = count_runs(blocks, num_blocks);
+        
+        if (num_runs == 0) {
+            continue;
+        }
+        
+        score->num_files++;
+        score->num_runs += num_runs;
+        
+        if (num_runs > 1) {
+            if (files != NULL) {
+                files[score->num_fragmented].inode_num = inode_num;
+                files[score->num_fragmented].num_runs = num_runs;
+            }
+            score->num_fragmented++;
+        }
+    }
+    
+    return score->num_fragmented;
+}
+
+
+/*
+ * Orders fragmented files from the most to the least fragmented.
+ */
+int compare_fragmented_files(const void *a, const void *b) {
+    const struct fragmented_file *x = a;
+    const struct fragmented_file *y = b;
+    
+    if (x->num_runs != y->num_runs) {
+        return y->num_runs - x->num_runs;
+    }
+    return (x->inode_num > y->inode_num) - (x->inode_num < y->inode_num);
+}
+
+
+/*
+ * Copies the block `from` into the block `to`.
+ */
+void copy_block(unsigned int from, unsigned int to) {
+    memcpy(BLOCK_START(disk, to), BLOCK_START(disk, from), EXT2_BLOCK_SIZE);
+}
+
+
+/*
+ * Moves the blocks of the given inode into a single run of free blocks,
+ * in the order they are read (the direct blocks, the indirect block, then
+ * the blocks it points to).
+ *
+ * The new blocks are written and flushed to the image file first, and only
+ * then are the inode's pointers switched over to them and the old blocks
+ * freed, so that the inode refers to a complete copy of its data at every
+ * point.
+ *
+ * Returns EXIT_SUCCESS, if the blocks were moved.
+ *               ENOSPC, if there is no free run large enough.
+ */
+int relocate_file(unsigned int inode_num) {
+    
+    struct ext2_group_desc *gd = get_group_descriptor();
+    struct ext2_inode *inode = get_inode_table() + INDEX(inode_num);
+    unsigned int old_blocks[MAX_INODE_BLOCKS];
+    
+    int num_blocks = collect_inode_blocks(inode, old_blocks);
+    unsigned int first_block_num = allocate_contiguous_blocks(num_blocks);
+    
+    if (first_block_num == UNDEFINED) {
+        return ENOSPC;
+    }
+    
+    unsigned int new_ptrs[NUM_DIRECT_PTRS + NUM_INDIRECT_PTRS];
+    unsigned int next_block_num = first_block_num;
+    
+    int n;
+    for (n = 0; n < NUM_DIRECT_PTRS + NUM_INDIRECT_PTRS; n++) {
+        new_ptrs[n] = UNDEFINED;
+        
+        if (inode->i_block[n] != UNDEFINED) {
+            copy_block(inode->i_block[n], next_block_num);
+            new_ptrs[n] = next_block_num++;
+        }
+    }
+    
+    // The copy of the indirect block still points to the old blocks
+    if (new_ptrs[NUM_DIRECT_PTRS] != UNDEFINED) {
+        unsigned int *indirect_block = (unsigned int *)
+                            BLOCK_START(disk, new_ptrs[NUM_DIRECT_PTRS]);
+        
+        for (n = 0; n < NUM_PTRS_PER_BLOCK; n++) {
+            if (indirect_block[n] != UNDEFINED) {
+                copy_block(indirect_block[n], next_block_num);
+                indirect_block[n] = next_block_num++;
+            }
+        }
+    }
+    
+    sync_blocks(first_block_num, num_blocks);
+    sync_blocks(gd->bg_block_bitmap, 1);
+    
+    // Switch the inode over to the new blocks
+    memcpy(inode->i_block, new_ptrs, sizeof(new_ptrs));
+    mark_inode_dirty(inode_num);
+    
+    unsigned int inode_offset = INDEX(inode_num) * sizeof(struct ext2_inode);
+    sync_blocks(gd->bg_inode_table + inode_offset / EXT2_BLOCK_SIZE, 1);
+    
+    for (n = 0; n < num_blocks; n++) {
+        free_block(old_blocks[n]);
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+
+/*
+ * Prints the given fragmentation score, as the average number of runs of
+ * blocks per file (1.00 when every file is contiguous).
+ */
+void print_score(char *label, struct fragmentation_score *score) {
+    
+    double average_runs = (score->num_files > 0) ?
+                          (double) score->num_runs / score->num_files : 1.0;
+    
+    printf("%s: %u of %u files fragmented, %u runs of blocks "\
+           "(score %.2f)\n", label, score->num_fragmented, score->num_files,
+           score->num_runs, average_runs);
+}
+
+
+int main(int argc, char *argv[]) {
+    
+    if (argc < MIN_ARGUMENT_V || argc > MAX_ARGUMENT_V ||
+        (argc == MAX_ARGUMENT_V && strcmp(argv[2], DRY_RUN_FLAG) != 0)) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    char *disk_image_path = argv[1];
+    int dry_run = (argc == MAX_ARGUMENT_V);
+    
+    disk = dry_run ? read_disk_image_readonly(disk_image_path) :
+                     read_disk_image(disk_image_path);
+    
+    struct fragmentation_score score;
+    struct fragmented_file *files = malloc(get_inodes_count() *
+                                           sizeof(struct fragmented_file));
+    
+    if (files == NULL) {
+        exit(ENOMEM);
+    }
+    
+    int num_fragmented = measure_fragmentation(files, &score);
+    print_score("Before", &score);
+    
+    if (dry_run) {
+        free(files);
+        return EXIT_SUCCESS;
+    }
+    
+    // Worst offenders first, while there is the most free space to use
+    qsort(files, num_fragmented, sizeof(struct fragmented_file),
+          compare_fragmented_files);
+    
+    int num_moved = 0;
+    
+    int i;
+    for (i = 0; i < num_fragmented; i++) {
+        if (relocate_file(files[i].inode_num) == EXIT_SUCCESS) {
+            num_moved++;
+        }
+    }
+    
+    measure_fragmentation(NULL, &score);
+    print_score("After", &score);
+    
+    printf("%d of %d fragmented files moved\n", num_moved, num_fragmented);
+    
+    free(files);
+    
+    return EXIT_SUCCESS;
+    
+}
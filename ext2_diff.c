@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ext2_utils.h"
+
+
+#define USAGE "Usage: %s <old image file name> <new image file name> "\
+                        "[<patch file name>] [-j <number of threads>]\n"\
+              "The patch is written to standard output if no file is given.\n"
+
+#define THREADS_FLAG "-j"
+
+#define MIN_ARGUMENT_V 3
+
+unsigned char *disk = NULL;
+
+// The image the patch is made against (`disk` is the new image)
+unsigned char *old_disk = NULL;
+
+
+/*
+ * A slice of the candidate blocks, compared by one thread.
+ */
+struct hash_shard {
+    pthread_t thread;
+    unsigned int *block_nums;     // Candidate blocks of this shard
+    int num_blocks;
+    unsigned int old_blocks_count;
+    unsigned char *changed;       // One byte per block of the new image
+};
+
+
+/*
+ * Marks, in `candidates`, the blocks of the new image that might differ
+ * from the old image: the boot block, and every block in use. Blocks free
+ * in the new image are not needed to replicate it.
+ *
+ * Returns the number of candidates.
+ */
+unsigned int mark_used_blocks(unsigned char *candidates) {
+    
+    unsigned int blocks_count = get_blocks_count();
+    unsigned int num_candidates = 0;
+    
+    unsigned int block_num;
+    for (block_num = 0; block_num < blocks_count; block_num++) {
+        candidates[block_num] = (block_num == 0 ||
+                                 is_block_in_use(block_num));
+        num_candidates += candidates[block_num];
+    }
+    
+    return num_candidates;
+}
+
+
+/*
+ * Returns the time of the most recent change recorded in the old image: the
+ * latest modification or change time of any inode in use, or the time the
+ * superblock was last written, if later.
+ */
+unsigned int find_last_change_time(struct ext2_inode *old_i_table,
+                                   unsigned char *old_inode_bitmap,
+                                   unsigned int inodes_count) {
+    
+    struct ext2_super_block *old_sb = (struct ext2_super_block *)
+                                            BLOCK_START(old_disk, 1);
+    unsigned int last_change = old_sb->s_wtime;
+    
+    unsigned int inode_num;
+    for (inode_num = NUM(0); inode_num <= inodes_count; inode_num++) {
+        struct ext2_inode *inode = old_i_table + INDEX(inode_num);
+        
+        if (!IS_IN_USE(old_inode_bitmap[INDEX(inode_num) / CHAR_BIT],
+                       INDEX(inode_num) % CHAR_BIT)) {
+            continue;
+        }
+        
+        if (inode->i_mtime > last_change) {
+            last_change = inode->i_mtime;
+        }
+        if (inode->i_ctime > last_change) {
+            last_change = inode->i_ctime;
+        }
+    }
+    
+    return last_change;
+}
+
+
+/*
+ * Clears, in `candidates`, the data blocks of every file whose inode is in
+ * use and byte for byte the same (including its modification and change
+ * times) in both images. Those blocks were not rewritten since the old
+ * image was taken. Directories, whose entries change without a change to
+ * their inode, and indirect blocks are always compared.
+ *
+ * Timestamps only have a resolution of one second, so a file written again
+ * in the same second as the last change recorded in the old image could
+ * look unchanged. Files changed in that second or later are always
+ * compared.
+ *
+ * Only done if both images hold the same file system (same UUID and inode
+ * count).
+ *
+ * Returns the number of candidates cleared.
+ */
+unsigned int skip_unchanged_inodes(unsigned char *candidates) {
+    
+    struct ext2_super_block *sb = get_super_block();
+    struct ext2_super_block *old_sb = (struct ext2_super_block *)
+                                            BLOCK_START(old_disk, 1);
+    struct ext2_group_desc *old_gd = (struct ext2_group_desc *)
+                                            BLOCK_START(old_disk, 2);
+    
+    if (memcmp(sb->s_uuid, old_sb->s_uuid, sizeof(sb->s_uuid)) != 0 ||
+        sb->s_inodes_count != old_sb->s_inodes_count) {
+        return 0;
+    }
+    
+    struct ext2_inode *i_table = get_inode_table();
+    struct ext2_inode *old_i_table = (struct ext2_inode *)
+                            BLOCK_START(old_disk, old_gd->bg_inode_table);
+    unsigned char *old_inode_bitmap = BLOCK_START(old_disk,
+                                                  old_gd->bg_inode_bitmap);
+    
+    unsigned int inodes_count = get_initialized_inodes_count();
+    unsigned int old_blocks_count = old_sb->s_blocks_count;
+    unsigned int blocks[MAX_INODE_BLOCKS];
+    unsigned int num_skipped = 0;
+    
+    unsigned int last_change = find_last_change_time(old_i_table,
+                                                     old_inode_bitmap,
+                                                     inodes_count);
+    
+    unsigned int inode_num;
+    for (inode_num = NUM(0); inode_num <= inodes_count; inode_num++) {
+        struct ext2_inode *inode = i_table + INDEX(inode_num);
+        
+        if (!is_inode_in_use(inode_num) ||
+            !IS_IN_USE(old_inode_bitmap[INDEX(inode_num) / CHAR_BIT],
+                       INDEX(inode_num) % CHAR_BIT) ||
+            IS_DIR(inode->i_mode) ||
+            inode->i_mtime >= last_change || inode->i_ctime >= last_change ||
+            memcmp(inode, old_i_table + INDEX(inode_num),
+                   sizeof(struct ext2_inode)) != 0) {
+            continue;
+        }
+        
+        int num_blocks = collect_inode_blocks(inode, blocks);
+        
+        int i;
+        for (i = 0; i < num_blocks; i++) {
+            unsigned int block_num = blocks[i];
+            
+            if (block_num != inode->i_block[NUM_DIRECT_PTRS] &&
+                block_num < old_blocks_count && candidates[block_num]) {
+                candidates[block_num] = FALSE;
+                num_skipped++;
+            }
+        }
+    }
+    
+    return num_skipped;
+}
+
+
+/*
+ * Returns the hash of the given block of a disk image.
+ */
+struct content_hash hash_block(unsigned char *image, unsigned int block_num) {
+    struct content_hash hash;
+    
+    init_content_hash(&hash);
+    update_content_hash(&hash, BLOCK_START(image, block_num),
+                        EXT2_BLOCK_SIZE);
+    
+    return hash;
+}
+
+
+/*
+ * Thread routine: compares the hashes of the shard's blocks in the old and
+ * new image, and marks the blocks that differ (or are new) as changed.
+ */
+void *hash_shard_blocks(void *arg) {
+    struct hash_shard *shard = (struct hash_shard *) arg;
+    
+    int i;
+    for (i = 0; i < shard->num_blocks; i++) {
+        unsigned int block_num = shard->block_nums[i];
+        
+        if (block_num >= shard->old_blocks_count) {
+            shard->changed[block_num] = TRUE;
+            continue;
+        }
+        
+        struct content_hash old_hash = hash_block(old_disk, block_num);
+        struct content_hash new_hash = hash_block(disk, block_num);
+        
+        shard->changed[block_num] =
+                        (compare_content_hash(&old_hash, &new_hash) != 0);
+    }
+    
+    return NULL;
+}
+
+
+/*
+ * Finds the candidate blocks that changed, hashing them in `num_threads`
+ * threads, each taking an equal share of the candidates.
+ */
+void find_changed_blocks(unsigned char *candidates,
+                         unsigned int num_candidates, unsigned char *changed,
+                         int num_threads) {
+    
+    unsigned int blocks_count = get_blocks_count();
+    unsigned int old_blocks_count = ((struct ext2_super_block *)
+                                     BLOCK_START(old_disk, 1))->s_blocks_count;
+    
+    unsigned int *block_nums = malloc((num_candidates + 1) *
+                                      sizeof(unsigned int));
+    struct hash_shard *shards = calloc(num_threads,
+                                       sizeof(struct hash_shard));
+    
+    if (block_nums == NULL || shards == NULL) {
+        exit(ENOMEM);
+    }
+    
+    unsigned int n = 0;
+    unsigned int block_num;
+    for (block_num = 0; block_num < blocks_count; block_num++) {
+        if (candidates[block_num]) {
+            block_nums[n++] = block_num;
+        }
+    }
+    
+    unsigned int shard_size = (num_candidates + num_threads - 1) /
+                              num_threads;
+    int t;
+    
+    for (t = 0; t < num_threads; t++) {
+        struct hash_shard *shard = &shards[t];
+        unsigned int first = t * shard_size;
+        
+        shard->block_nums = block_nums + first;
+        shard->num_blocks = (first >= num_candidates) ? 0 :
+                            ((first + shard_size > num_candidates) ?
+                             num_candidates - first : shard_size);
+        shard->old_blocks_count = old_blocks_count;
+        shard->changed = changed;
+        
+        if (pthread_create(&shard->thread, NULL, hash_shard_blocks,
+                           shard) != 0) {
+            perror("pthread_create - Could not start hashing thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    for (t = 0; t < num_threads; t++) {
+        pthread_join(shards[t].thread, NULL);
+    }
+    
+    free(shards);
+    free(block_nums);
+}
+
+
+/*
+ * Collects the runs of consecutive changed blocks into `runs`, which has
+ * room for one run per two blocks.
+ *
+ * Returns the number of runs collected.
+ */
+int collect_changed_runs(unsigned char *changed, struct dump_run *runs) {
+    
+    unsigned int blocks_count = get_blocks_count();
+    int num_runs = 0;
+    
+    unsigned int block_num = 0;
+    while (block_num < blocks_count) {
+        
+        if (!changed[block_num]) {
+            block_num++;
+            continue;
+        }
+        
+        runs[num_runs].first_block_num = block_num;
+        while (block_num < blocks_count && changed[block_num]) {
+            block_num++;
+        }
+        runs[num_runs].count = block_num - runs[num_runs].first_block_num;
+        num_runs++;
+    }
+    
+    return num_runs;
+}
+
+
+int main(int argc, char *argv[]) {
+    
+    if (argc < MIN_ARGUMENT_V) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    char *old_disk_image_path = argv[1];
+    char *new_disk_image_path = argv[2];
+    char *patch_path = NULL;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    int i;
+    for (i = MIN_ARGUMENT_V; i < argc; i++) {
+        if (strcmp(argv[i], THREADS_FLAG) == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        }
+        else if (patch_path == NULL && argv[i][0] != '-') {
+            patch_path = argv[i];
+        }
+        else {
+            fprintf(stderr, USAGE, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    
+    old_disk = read_disk_image_readonly(old_disk_image_path);
+    disk = read_disk_image_readonly(new_disk_image_path);
+    
+    int fd = STDOUT_FILENO;
+    
+    if (patch_path != NULL) {
+        fd = open(patch_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        
+        if (fd < 0) {
+            perror("open - Could not create patch file");
+            return errno;
+        }
+    }
+    
+    unsigned int blocks_count = get_blocks_count();
+    unsigned char *candidates = malloc(blocks_count);
+    unsigned char *changed = calloc(blocks_count, sizeof(unsigned char));
+    struct dump_run *runs = malloc((blocks_count / 2 + 1) *
+                                   sizeof(struct dump_run));
+    
+    if (candidates == NULL || changed == NULL || runs == NULL) {
+        exit(ENOMEM);
+    }
+    
+    unsigned int num_used = mark_used_blocks(candidates);
+    unsigned int num_candidates = num_used -
+                                  skip_unchanged_inodes(candidates);
+    
+    find_changed_blocks(candidates, num_candidates, changed, num_threads);
+    
+    // The patch only applies to an image in the state of the old image
+    struct content_hash base;
+    hash_image_identity(old_disk, &base);
+    
+    int num_runs = collect_changed_runs(changed, runs);
+    int result = write_block_runs(fd, PATCH_MAGIC, &base, runs, num_runs);
+    
+    if (result != EXIT_SUCCESS) {
+        fprintf(stderr, "write - Could not write patch: %s\n",
+                strerror(result));
+        return result;
+    }
+    
+    if (fd != STDOUT_FILENO && close(fd) != 0) {
+        perror("close - Could not write patch");
+        return errno;
+    }
+    
+    unsigned int num_changed = 0;
+    for (i = 0; i < num_runs; i++) {
+        num_changed += runs[i].count;
+    }
+    
+    fprintf(stderr, "%u blocks in use, %u compared, %u changed\n",
+            num_used, num_candidates, num_changed);
+    
+    free(candidates);
+    free(changed);
+    free(runs);
+    
+    return EXIT_SUCCESS;
+    
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ext2_utils.h"
+
+
+#define USAGE "Usage: %s <image file name> [<dump file name>]\n"\
+              "The dump is written to standard output if no file is given, "\
+              "e.g. to be compressed:\n"\
+              "    %s disk.img | zstd -T0 > disk.dump.zst\n"
+
+#define MIN_ARGUMENT_V 2
+#define MAX_ARGUMENT_V 3
+
+unsigned char *disk = NULL;
+
+
+/*
+ * Returns TRUE if the given block needs to be dumped: it is in use (or it
+ * is the boot block, which the bitmap does not cover), and it is not all
+ * zeroes. Blocks that are left out are recreated as holes.
+ */
+int is_block_dumped(unsigned int block_num) {
+    
+    static unsigned char zero_block[EXT2_BLOCK_SIZE];
+    
+    if (block_num != 0 && !is_block_in_use(block_num)) {
+        return FALSE;
+    }
+    
+    return memcmp(BLOCK_START(disk, block_num), zero_block,
+                  EXT2_BLOCK_SIZE) != 0;
+}
+
+
+/*
+ * Collects the runs of consecutive blocks to be dumped into `runs`, which
+ * has room for one run per two blocks.
+ *
+ * Returns the number of runs collected.
+ */
+int collect_dump_runs(struct dump_run *runs) {
+    
+    unsigned int blocks_count = get_blocks_count();
+    int num_runs = 0;
+    
+    unsigned int block_num = 0;
+    while (block_num < blocks_count) {
+        
+        if (!is_block_dumped(block_num)) {
+            block_num++;
+            continue;
+        }
+        
+        runs[num_runs].first_block_num = block_num;
+        while (block_num < blocks_count && is_block_dumped(block_num)) {
+            block_num++;
+        }
+        runs[num_runs].count = block_num - runs[num_runs].first_block_num;
+        num_runs++;
+    }
+    
+    return num_runs;
+}
+
+
+/*
+ * Writes the dump of the disk image to the given file.
+ *
+ * Returns the number of blocks dumped, or exits with the write error.
+ */
+unsigned int write_dump(int fd) {
+    
+    struct dump_run *runs = malloc((get_blocks_count() / 2 + 1) *
+                                   sizeof(struct dump_run));
+    
+    if (runs == NULL) {
+        exit(ENOMEM);
+    }
+    
+    int num_runs = collect_dump_runs(runs);
+    int result = write_block_runs(fd, DUMP_MAGIC, NULL, runs, num_runs);
+    
+    if (result != EXIT_SUCCESS) {
+        fprintf(stderr, "write - Could not write dump: %s\n",
+                strerror(result));
+        exit(result);
+    }
+    
+    unsigned int num_dumped = 0;
+    
+    int i;
+    for (i = 0; i < num_runs; i++) {
+        num_dumped += runs[i].count;
+    }
+    
+    free(runs);
+    
+    return num_dumped;
+}
+
+
+int main(int argc, char *argv[]) {
+    
+    if (argc < MIN_ARGUMENT_V || argc > MAX_ARGUMENT_V) {
+        fprintf(stderr, USAGE, argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    char *disk_image_path = argv[1];
+    int fd = STDOUT_FILENO;
+    
+    if (argc == MAX_ARGUMENT_V) {
+        fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        
+        if (fd < 0) {
+            perror("open - Could not create dump file");
+            return errno;
+        }
+    }
+    
+    disk = read_disk_image_readonly(disk_image_path);
+    
+    // Every block that is dumped is read in order
+    advise_blocks(0, get_blocks_count(), MADV_SEQUENTIAL);
+    
+    unsigned int num_dumped = write_dump(fd);
+    
+    if (fd != STDOUT_FILENO && close(fd) != 0) {
+        perror("close - Could not write dump");
+        return errno;
+    }
+    
+    fprintf(stderr, "%u of %u blocks dumped\n", num_dumped,
+            get_blocks_count());
+    
+    return EXIT_SUCCESS;
+    
+}
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "ext2_utils.h"
+
+
+#define USAGE "Usage: %s <image file name>\n"
+
+#define NUM_ARGUMENT_V 2
+
+unsigned char *disk = NULL;
+
+
+/*
+ * Discards every run of free blocks in the block bitmap from the disk
+ * image file.
+ *
+ * Returns the total number of blocks discarded, or exits with the error
+ * returned by the host file system.
+ */
+unsigned int trim_free_blocks() {
+    
+    unsigned int blocks_count = get_blocks_count();
+    unsigned int num_discarded = 0;
+    
+    unsigned int block_num = NUM(0);
+    while (block_num < blocks_count) {
+        
+        // Skip over blocks in use
+        if (is_block_in_use(block_num)) {
+            block_num++;
+            continue;
+        }
+        
+        // Find the end of this run of free blocks
+        unsigned int run_start = block_num;
+        while (block_num < blocks_count && !is_block_in_use(block_num)) {
+            block_num++;
+        }
+        
+        int result = discard_blocks(run_start, block_num - run_start);
+        if (result != EXIT_SUCCESS) {
+            perror("fallocate - Could not discard free blocks");
+            exit(result);
+        }
+        
+        num_discarded += block_num - run_start;
+    }
+    
+    return num_discarded;
+}
+
+
+int main(int argc, char *argv[]) {
+    
+    if (argc != NUM_ARGUMENT_V) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    char *disk_image_path = argv[1];
+    
+    disk = read_disk_image(disk_image_path);
+    
+    unsigned int num_discarded = trim_free_blocks();
+    
+    printf("%u free blocks (%llu bytes) discarded\n", num_discarded,
+           (unsigned long long) num_discarded * EXT2_BLOCK_SIZE);
+    
+    return EXIT_SUCCESS;
+    
+}
@@ -5,21 +5,104 @@
 #include "ext2_utils.h"
 
 
-#define USAGE "Usage: %s <image file name> <absolute path on ext2 image>\n"
+#define USAGE "Usage: %s <image file name> [-p] "\
+                        "<absolute path on ext2 image>...\n"
 
-#define NUM_ARGUMENT_V 3
+#define PARENTS_FLAG "-p"
+
+#define MIN_ARGUMENT_V 3
 
 unsigned char *disk = NULL;
 
 
 /*
- * Creates a directory with the given path.
+ * Preallocates s_prealloc_dir_blocks contiguous blocks for the given (new)
+ * directory inode, if the file system enables directory preallocation.
+ * Each block holds a single empty entry, so that they are filled in order
+ * as the directory grows.
+ */
+void preallocate_dir_blocks(struct ext2_inode *dir_inode) {
+    
+    struct ext2_super_block *sb = get_super_block();
+    int count = sb->s_prealloc_dir_blocks;
+    
+    if (!(sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_PREALLOC) ||
+        count == 0) {
+        return;
+    }
+    
+    if (count > NUM_DIRECT_PTRS) {
+        count = NUM_DIRECT_PTRS;
+    }
+    
+    unsigned int first_block_num = allocate_contiguous_blocks(count);
+    
+    // Not enough contiguous space, let the directory grow on demand instead
+    if (first_block_num == UNDEFINED) {
+        return;
+    }
+    
+    int n;
+    for (n = 0; n < count; n++) {
+        unsigned int block_num = first_block_num + n;
+        
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)
+                                            BLOCK_START(disk, block_num);
+        entry->rec_len = EXT2_BLOCK_SIZE;
+        
+        dir_inode->i_block[n] = block_num;
+        dir_inode->i_size += EXT2_BLOCK_SIZE;
+        dir_inode->i_blocks = NUM_DISK_BLKS(dir_inode->i_blocks,
+                                            EXT2_BLOCK_SIZE);
+    }
+}
+
+
+/*
+ * Creates a directory by the given name inside the directory with inode
+ * `parent_inode_num`.
+ *
+ * Returns the inode number of the new directory.
+ */
+unsigned int make_directory(unsigned int parent_inode_num, char *name) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    struct ext2_inode *parent_inode = i_table + INDEX(parent_inode_num);
+    
+    struct ext2_dir_entry *new_entry =
+                    create_dir_entry(parent_inode, UNDEFINED, name, EXT2_FT_DIR);
+    
+    get_group_descriptor()->bg_used_dirs_count++;
+    
+    unsigned int new_inode_num = new_entry->inode;
+    struct ext2_inode *new_inode = i_table + INDEX(new_inode_num);
+    
+    preallocate_dir_blocks(new_inode);
+    
+    // Create entry for self (.) inside new directory
+    create_dir_entry(new_inode, new_inode_num, CURRENT_DIR, EXT2_FT_DIR);
+    
+    // Create entry for parent directory (..) inside new directory
+    create_dir_entry(new_inode, parent_inode_num, PARENT_DIR, EXT2_FT_DIR);
+    
+    return new_inode_num;
+}
+
+
+/*
+ * Creates a directory with the given path. If `parents` is set, missing
+ * directories in the path are created as well, and it is not an error for
+ * the directory to exist already.
+ *
+ * The leading components that `path` shares with the previous path are
+ * looked up in `prefix` rather than resolved again, and `prefix` is
+ * updated to hold the components of `path`.
  *
  * Returns EXIT_SUCCESS, if the directory was successfully created.
  *               ENOENT, if one or more entries in the path don't exist.
  *               EEXIST, if the directory to be created already exists.
  */
-int create_directory(char *path) {
+int create_directory(char *path, int parents, struct resolved_prefix *prefix) {
     
     // Ensure that file_path starts with a '/'
     if (!IS_PATH_ABSOLUTE(path)) {
@@ -28,76 +111,156 @@ int create_directory(char *path) {
     
     struct ext2_inode *i_table = get_inode_table();
     
+    // Keep the previous path's names alive until they have been compared
+    char *prev_path = prefix->path;
+    char **prev_names = prefix->names;
+    unsigned int *prev_inodes = prefix->inodes;
+    int prev_depth = prefix->depth;
+    
+    // A path has at most one component per two characters ("/a")
+    int path_len = strlen(path) + 1;
+    int max_depth = path_len / 2 + 1;
+    
+    prefix->path = malloc(path_len);
+    prefix->names = malloc(max_depth * sizeof(char *));
+    prefix->inodes = malloc(max_depth * sizeof(unsigned int));
+    prefix->depth = 0;
+    
+    if (prefix->path == NULL || prefix->names == NULL ||
+        prefix->inodes == NULL) {
+        exit(ENOMEM);
+    }
+    
+    strncpy(prefix->path, path, path_len);
+    
     // The inode of the current directory
     unsigned int curr_inode_num = NUM(EXT2_ROOT_INO_IDX);
-    struct ext2_inode *curr_inode = i_table + EXT2_ROOT_INO_IDX;
+    int shared = TRUE;
+    int result = ENOENT;
     
-    char *token = strtok(path, DIR_DELIMITER);
+    char *token = strtok(prefix->path, DIR_DELIMITER);
     
-    // Current Directory Entry in path
-    struct ext2_dir_entry *curr_dir_entry = find_entry(curr_inode, token);
+    // Path refers to the root directory
+    if (token == NULL) {
+        result = parents ? EXIT_SUCCESS : EEXIST;
+    }
     
     while (token != NULL) {
         char *next_token = strtok(NULL, DIR_DELIMITER);
+        int depth = prefix->depth;
         
-        if (curr_dir_entry == NULL) {
+        // Reuse the directory resolved for the previous path
+        if (shared && depth < prev_depth &&
+            strcmp(prev_names[depth], token) == 0) {
             
-            // Path does not exist
-            if (next_token != NULL) {
-                return ENOENT;
-            }
+            curr_inode_num = prev_inodes[depth];
+        }
+        else {
+            shared = FALSE;
             
-            // Everything good, create new directory
-            struct ext2_dir_entry *new_entry =
-                            create_dir_entry(curr_inode, UNDEFINED, token, EXT2_FT_DIR);
-                            
-            get_group_descriptor()->bg_used_dirs_count++;
+            struct ext2_inode *curr_inode = i_table + INDEX(curr_inode_num);
+            struct ext2_dir_entry *curr_dir_entry = find_entry(curr_inode,
+                                                               token);
             
-            // Create entry for self (.) inside new directory
-            struct ext2_inode *new_inode = i_table + INDEX(new_entry->inode);
-            create_dir_entry(new_inode, new_entry->inode, CURRENT_DIR, EXT2_FT_DIR);
+            if (curr_dir_entry == NULL) {
+                
+                // Path does not exist
+                if (next_token != NULL && !parents) {
+                    result = ENOENT;
+                    break;
+                }
+                
+                // Everything good, create new directory
+                curr_inode_num = make_directory(curr_inode_num, token);
+                
+                if (next_token == NULL) {
+                    result = EXIT_SUCCESS;
+                }
+            }
             
-            // Create entry for parent directory (..) inside new directory
-            create_dir_entry(new_inode, curr_inode_num, PARENT_DIR, EXT2_FT_DIR);
+            // One or more entries in the path is not a directory.
+            else if (curr_dir_entry->file_type != EXT2_FT_DIR) {
+                result = (next_token == NULL) ? EEXIST : ENOENT;
+                break;
+            }
+            
+            // Reached end of path. Target already exists
+            else if (next_token == NULL) {
+                result = parents ? EXIT_SUCCESS : EEXIST;
+                curr_inode_num = curr_dir_entry->inode;
+            }
             
-            return EXIT_SUCCESS;
+            // Everything good, continue traversing path
+            else {
+                curr_inode_num = curr_dir_entry->inode;
+            }
         }
         
-        // Reached end of path. Target already exists
-        else if (next_token == NULL) {
-            return EEXIST;
-        }
-            
-        // One or more entries in the path is not a directory.
-        else if (curr_dir_entry->file_type != EXT2_FT_DIR) {
-            return ENOENT;
+        // Only directories that exist (or were created) are remembered
+        prefix->names[depth] = token;
+        prefix->inodes[depth] = curr_inode_num;
+        prefix->depth++;
+        
+        // The whole path was already resolved for the previous path
+        if (shared && next_token == NULL) {
+            result = parents ? EXIT_SUCCESS : EEXIST;
         }
-            
-        // Everything good, continue traversing path
-        token = next_token;
         
-        curr_inode_num = curr_dir_entry->inode;
-        curr_inode =  i_table + INDEX(curr_inode_num);
-        curr_dir_entry = find_entry(curr_inode, token);
+        token = next_token;
     }
     
-    // Path does not exist
-    return ENOENT;
+    free(prev_path);
+    free(prev_names);
+    free(prev_inodes);
+    
+    return result;
 }
 
 
 int main(int argc, char *argv[]) {
     
-    if (argc != NUM_ARGUMENT_V) {
+    if (argc < MIN_ARGUMENT_V) {
         fprintf(stderr, USAGE, argv[0]);
         return EXIT_FAILURE;
     }
     
     char *disk_image_path = argv[1];
-    char *target_path = argv[2];
+    int first_path = 2;
+    int parents = FALSE;
+    
+    // Check if flag for creating parent directories is present
+    if (strcmp(argv[first_path], PARENTS_FLAG) == 0) {
+        parents = TRUE;
+        first_path++;
+    }
+    
+    if (first_path >= argc) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
     
     disk = read_disk_image(disk_image_path);
     
-    return create_directory(target_path);
+    struct resolved_prefix prefix = { NULL, NULL, NULL, 0 };
+    int result = EXIT_SUCCESS;
+    int num_paths = argc - first_path;
+    
+    int i;
+    for (i = first_path; i < argc; i++) {
+        int path_result = create_directory(argv[i], parents, &prefix);
+        
+        if (path_result == EXIT_SUCCESS) {
+            continue;
+        }
+        
+        if (num_paths > 1) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(path_result));
+        }
+        if (result == EXIT_SUCCESS) {
+            result = path_result;
+        }
+    }
+    
+    return result;
 
 }
\ No newline at end of file
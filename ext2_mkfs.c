@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ext2_utils.h"
+
+
+#define USAGE "Usage: %s <image file name> <number of blocks> "\
+                        "[-N <number of inodes>]\n"
+
+#define INODES_FLAG "-N"
+
+#define MIN_ARGUMENT_V 3
+#define MAX_ARGUMENT_V 5
+
+// A single block group, whose bitmaps each fit in one block
+#define BLOCKS_PER_GROUP (EXT2_BLOCK_SIZE * CHAR_BIT)
+#define INODES_PER_BLOCK (EXT2_BLOCK_SIZE / sizeof(struct ext2_inode))
+
+// Boot block, superblock, group descriptor and the two bitmaps
+#define FIRST_INODE_TABLE_BLOCK 5
+
+// One inode for every 4 KiB of disk, as mke2fs does by default
+#define BYTES_PER_INODE 4096
+
+// Root, lost+found and a few files beyond the reserved inodes
+#define MIN_INODES 16
+
+#define RESERVED_BLOCKS_PERCENT 5
+
+#define EXT2_SUPER_MAGIC 0xEF53
+#define EXT2_DYNAMIC_REV 1
+#define EXT2_VALID_FS 1
+#define EXT2_ERRORS_CONTINUE 1
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+
+#define LOST_FOUND_NAME "lost+found"
+
+unsigned char *disk = NULL;
+
+
+/*
+ * Sets the bits of the given bitmap block from `first_bit` to the end of the
+ * block, so that the resources past the end of the file system are never
+ * allocated.
+ */
+void set_padding_bits(unsigned char *bitmap, unsigned int first_bit) {
+    
+    unsigned int bit;
+    for (bit = first_bit; bit < BLOCKS_PER_GROUP; bit++) {
+        bitmap[bit / CHAR_BIT] |= 1 << (bit % CHAR_BIT);
+    }
+}
+
+
+/*
+ * Fills in a random (version 4) UUID.
+ */
+void generate_uuid(unsigned char *uuid) {
+    
+    srand(time(NULL) ^ getpid());
+    
+    int i;
+    for (i = 0; i < 16; i++) {
+        uuid[i] = rand();
+    }
+    
+    uuid[6] = (uuid[6] & 0x0F) | 0x40;
+    uuid[8] = (uuid[8] & 0x3F) | 0x80;
+}
+
+
+/*
+ * Writes the superblock, group descriptor and bitmaps of an empty file
+ * system with the given geometry.
+ *
+ * Only the inodes that are written (the reserved inodes and those of the
+ * root and lost+found) are counted as initialized. The rest of the inode
+ * table is never written, and is left as a hole in the image file.
+ */
+void write_metadata(unsigned int blocks_count, unsigned int inodes_count) {
+    
+    struct ext2_super_block *sb = get_super_block();
+    struct ext2_group_desc *gd = get_group_descriptor();
+    
+    unsigned int i_table_blocks = inodes_count / INODES_PER_BLOCK;
+    unsigned int current_time = get_timestamp();
+    
+    sb->s_inodes_count = inodes_count;
+    sb->s_blocks_count = blocks_count;
+    sb->s_r_blocks_count = blocks_count * RESERVED_BLOCKS_PERCENT / 100;
+    sb->s_free_blocks_count = blocks_count - 1;
+    sb->s_free_inodes_count = inodes_count;
+    sb->s_first_data_block = 1;
+    sb->s_log_block_size = 0;
+    sb->s_log_frag_size = 0;
+    sb->s_blocks_per_group = BLOCKS_PER_GROUP;
+    sb->s_frags_per_group = BLOCKS_PER_GROUP;
+    sb->s_inodes_per_group = inodes_count;
+    sb->s_wtime = current_time;
+    sb->s_lastcheck = current_time;
+    sb->s_max_mnt_count = (unsigned short) -1;
+    sb->s_magic = EXT2_SUPER_MAGIC;
+    sb->s_state = EXT2_VALID_FS;
+    sb->s_errors = EXT2_ERRORS_CONTINUE;
+    sb->s_rev_level = EXT2_DYNAMIC_REV;
+    sb->s_first_ino = EXT2_GOOD_OLD_FIRST_INO_IDX;
+    sb->s_inode_size = sizeof(struct ext2_inode);
+    sb->s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+    generate_uuid(sb->s_uuid);
+    
+    gd->bg_block_bitmap = FIRST_INODE_TABLE_BLOCK - 2;
+    gd->bg_inode_bitmap = FIRST_INODE_TABLE_BLOCK - 1;
+    gd->bg_inode_table = FIRST_INODE_TABLE_BLOCK;
+    gd->bg_free_blocks_count = sb->s_free_blocks_count;
+    gd->bg_free_inodes_count = sb->s_free_inodes_count;
+    
+    // No inode has been written yet
+    gd->bg_pad &= ~EXT2_BG_INODE_ZEROED;
+    BG_INODES_UNWRITTEN(gd) = inodes_count;
+    
+    // Block 0 is not covered by the bitmap (the first data block is 1)
+    set_padding_bits(get_block_bitmap(), blocks_count - 1);
+    set_padding_bits(get_inode_bitmap(), inodes_count);
+    
+    unsigned int block_num;
+    for (block_num = NUM(0);
+         block_num < FIRST_INODE_TABLE_BLOCK + i_table_blocks; block_num++) {
+        set_block_in_use(block_num);
+    }
+    
+    unsigned int inode_num;
+    for (inode_num = NUM(0); inode_num < EXT2_GOOD_OLD_FIRST_INO_IDX;
+         inode_num++) {
+        set_inode_in_use(inode_num);
+    }
+}
+
+
+/*
+ * Creates the root directory, and lost+found inside it.
+ */
+void create_root_directory() {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    struct ext2_inode *root_inode = i_table + EXT2_ROOT_INO_IDX;
+    unsigned int root_inode_num = NUM(EXT2_ROOT_INO_IDX);
+    unsigned int current_time = get_timestamp();
+    
+    root_inode->i_mode = EXT2_S_IFDIR | 0755;
+    root_inode->i_ctime = current_time;
+    root_inode->i_atime = current_time;
+    root_inode->i_mtime = current_time;
+    
+    create_dir_entry(root_inode, root_inode_num, CURRENT_DIR, EXT2_FT_DIR);
+    create_dir_entry(root_inode, root_inode_num, PARENT_DIR, EXT2_FT_DIR);
+    get_group_descriptor()->bg_used_dirs_count++;
+    
+    struct ext2_dir_entry *entry = create_dir_entry(root_inode, UNDEFINED,
+                                                    LOST_FOUND_NAME,
+                                                    EXT2_FT_DIR);
+    get_group_descriptor()->bg_used_dirs_count++;
+    
+    unsigned int lost_found_num = entry->inode;
+    struct ext2_inode *lost_found = i_table + INDEX(lost_found_num);
+    
+    lost_found->i_mode |= 0700;
+    
+    create_dir_entry(lost_found, lost_found_num, CURRENT_DIR, EXT2_FT_DIR);
+    create_dir_entry(lost_found, root_inode_num, PARENT_DIR, EXT2_FT_DIR);
+}
+
+
+/*
+ * Parses the given command line argument as a count into `count`.
+ *
+ * Returns EXIT_SUCCESS, or EINVAL if it is not a whole number that fits.
+ */
+int parse_count(char *arg, unsigned int *count) {
+    
+    char *end;
+    unsigned long value = strtoul(arg, &end, 10);
+    
+    if (*arg == '\0' || *end != '\0' || value > (unsigned int) -1) {
+        return EINVAL;
+    }
+    
+    *count = value;
+    
+    return EXIT_SUCCESS;
+}
+
+
+int main(int argc, char *argv[]) {
+    
+    if (argc != MIN_ARGUMENT_V && (argc != MAX_ARGUMENT_V ||
+                                   strcmp(argv[3], INODES_FLAG) != 0)) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    char *disk_image_path = argv[1];
+    unsigned int blocks_count;
+    unsigned int inodes_count;
+    
+    if (parse_count(argv[2], &blocks_count) != EXIT_SUCCESS ||
+        (argc == MAX_ARGUMENT_V &&
+         parse_count(argv[4], &inodes_count) != EXIT_SUCCESS)) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    if (argc != MAX_ARGUMENT_V) {
+        inodes_count = blocks_count / (BYTES_PER_INODE / EXT2_BLOCK_SIZE);
+    }
+    
+    // Round up to whole inode table blocks
+    if (inodes_count < MIN_INODES) {
+        inodes_count = MIN_INODES;
+    }
+    inodes_count = (inodes_count + INODES_PER_BLOCK - 1) /
+                   INODES_PER_BLOCK * INODES_PER_BLOCK;
+    
+    unsigned int i_table_blocks = inodes_count / INODES_PER_BLOCK;
+    
+    // Everything has to fit in one group, with room for the root directory
+    // and lost+found
+    if (blocks_count > BLOCKS_PER_GROUP || inodes_count > BLOCKS_PER_GROUP ||
+        blocks_count < FIRST_INODE_TABLE_BLOCK + i_table_blocks + 2) {
+        fprintf(stderr, "%s: %u blocks and %u inodes do not fit in one "\
+                "block group of at most %d blocks\n", disk_image_path,
+                blocks_count, inodes_count, BLOCKS_PER_GROUP);
+        return EINVAL;
+    }
+    
+    // The image is created sparse, so only the blocks written below take up
+    // space on the host
+    int fd = open(disk_image_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    
+    if (fd < 0 || ftruncate(fd, blocks_count * EXT2_BLOCK_SIZE) != 0) {
+        perror("Could not create disk image");
+        return errno;
+    }
+    
+    close(fd);
+    
+    disk = read_disk_image(disk_image_path);
+    
+    write_metadata(blocks_count, inodes_count);
+    create_root_directory();
+    
+    // Any logs kept for an earlier image at this path no longer apply
+    clear_dirty_log();
+    clear_tombstone_log();
+    
+    printf("%u blocks, %u inodes (%u initialized)\n", blocks_count,
+           inodes_count, get_initialized_inodes_count());
+    
+    return EXIT_SUCCESS;
+    
+}
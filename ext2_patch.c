@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ext2_utils.h"
+
+
+#define USAGE "Usage: %s <image file name> [<patch file name>]\n"\
+              "The patch is read from standard input if no file is given.\n"
+
+#define MIN_ARGUMENT_V 2
+#define MAX_ARGUMENT_V 3
+
+unsigned char *disk = NULL;
+
+
+int main(int argc, char *argv[]) {
+    
+    if (argc < MIN_ARGUMENT_V || argc > MAX_ARGUMENT_V) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    char *disk_image_path = argv[1];
+    int patch_fd = STDIN_FILENO;
+    
+    if (argc == MAX_ARGUMENT_V) {
+        patch_fd = open(argv[2], O_RDONLY);
+        
+        if (patch_fd < 0) {
+            perror("open - Could not open patch file");
+            return errno;
+        }
+    }
+    
+    int image_fd = open(disk_image_path, O_RDWR);
+    
+    if (image_fd < 0) {
+        perror("open - Could not open disk image");
+        return errno;
+    }
+    
+    // The image must be the one the patch was made against
+    unsigned char identity_blocks[IMAGE_IDENTITY_BLOCKS * EXT2_BLOCK_SIZE];
+    
+    if (pread(image_fd, identity_blocks, sizeof(identity_blocks), 0) !=
+        sizeof(identity_blocks)) {
+        fprintf(stderr, "Could not read disk image\n");
+        return EINVAL;
+    }
+    
+    struct content_hash base;
+    hash_image_identity(identity_blocks, &base);
+    
+    unsigned int num_written;
+    int result = read_block_runs(patch_fd, image_fd, PATCH_MAGIC, &base,
+                                 &num_written);
+    
+    if (result == ESTALE) {
+        fprintf(stderr, "Could not apply patch: the image is not the one "\
+                "it was made against\n");
+        return result;
+    }
+    
+    if (result != EXIT_SUCCESS) {
+        fprintf(stderr, "Could not apply patch: %s\n", strerror(result));
+        return result;
+    }
+    
+    if (close(image_fd) != 0) {
+        perror("close - Could not write disk image");
+        return errno;
+    }
+    
+    fprintf(stderr, "%u blocks patched\n", num_written);
+    
+    return EXIT_SUCCESS;
+    
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "ext2_utils.h"
+
+
+#define USAGE "Usage: %s [<number of bits> [<number of rounds>]]\n"
+
+#define DEFAULT_NUM_BITS (64 * 1024 * 1024)
+#define DEFAULT_NUM_ROUNDS 20
+
+unsigned char *disk = NULL;
+
+
+/*
+ * Times `num_rounds` calls of count_set_bits() on the given bitmap with the
+ * given kernel, and prints the throughput.
+ *
+ * Returns the number of bits counted, or -1 if the CPU lacks the kernel.
+ */
+long long bench_kernel(int kernel, char *name, unsigned char *bitmap,
+                       unsigned int num_bits, int num_rounds) {
+    
+    if (select_popcount_kernel(kernel) != kernel) {
+        printf("%-8s not supported by this CPU\n", name);
+        return -1;
+    }
+    
+    unsigned int count = 0;
+    double start = get_seconds();
+    
+    int i;
+    for (i = 0; i < num_rounds; i++) {
+        count = count_set_bits(bitmap, num_bits);
+    }
+    
+    double elapsed = get_seconds() - start;
+    double bytes = (double) num_bits / CHAR_BIT * num_rounds;
+    
+    printf("%-8s %10u bits set  %8.3f ms/round  %8.2f GB/s\n", name, count,
+           elapsed * 1e3 / num_rounds, bytes / elapsed / 1e9);
+    
+    return count;
+}
+
+
+int main(int argc, char *argv[]) {
+    
+    if (argc > 3) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    unsigned int num_bits = (argc > 1) ? strtoul(argv[1], NULL, 10) :
+                                         DEFAULT_NUM_BITS;
+    int num_rounds = (argc > 2) ? atoi(argv[2]) : DEFAULT_NUM_ROUNDS;
+    
+    if (num_bits == 0 || num_rounds < 1) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    unsigned char *bitmap = malloc(num_bits / CHAR_BIT + 1);
+    
+    if (bitmap == NULL) {
+        return ENOMEM;
+    }
+    
+    // A fixed seed, so that every run counts the same bitmap
+    srand(EXT2_BLOCK_SIZE);
+    
+    unsigned int i;
+    for (i = 0; i <= num_bits / CHAR_BIT; i++) {
+        bitmap[i] = rand();
+    }
+    
+    long long expected = bench_kernel(POPCOUNT_SCALAR, "scalar", bitmap,
+                                      num_bits, num_rounds);
+    long long avx2 = bench_kernel(POPCOUNT_AVX2, "avx2", bitmap,
+                                  num_bits, num_rounds);
+    long long avx512 = bench_kernel(POPCOUNT_AVX512, "avx512", bitmap,
+                                    num_bits, num_rounds);
+    
+    free(bitmap);
+    
+    if ((avx2 >= 0 && avx2 != expected) ||
+        (avx512 >= 0 && avx512 != expected)) {
+        fprintf(stderr, "Kernels disagree on the number of bits set\n");
+        return EXIT_FAILURE;
+    }
+    
+    return EXIT_SUCCESS;
+    
+}
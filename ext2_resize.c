@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "ext2_utils.h"
+
+
+#define USAGE "Usage: %s <image file name> <new number of blocks>\n"
+
+#define NUM_ARGUMENT_V 3
+
+unsigned char *disk = NULL;
+
+
+/*
+ * Extends the file system from `old_blocks_count` blocks to
+ * `new_blocks_count` blocks. The new blocks are added at the end of the
+ * block group as free blocks, so nothing that is already on the disk moves.
+ * The reserved blocks count grows in proportion.
+ */
+void grow_file_system(unsigned int old_blocks_count,
+                      unsigned int new_blocks_count) {
+    
+    struct ext2_super_block *sb = get_super_block();
+    
+    // The bits of the new blocks were padding, marked in-use
+    unsigned int block_num;
+    for (block_num = old_blocks_count; block_num < new_blocks_count;
+         block_num++) {
+        free_block(block_num);
+    }
+    
+    sb->s_r_blocks_count = (unsigned long long) sb->s_r_blocks_count *
+                           new_blocks_count / old_blocks_count;
+    sb->s_blocks_count = new_blocks_count;
+    sb->s_wtime = get_timestamp();
+}
+
+
+int main(int argc, char *argv[]) {
+    
+    if (argc != NUM_ARGUMENT_V) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    char *disk_image_path = argv[1];
+    char *blocks_arg = argv[2];
+    
+    char *end;
+    unsigned long blocks = strtoul(blocks_arg, &end, 10);
+    
+    if (*blocks_arg == '\0' || *end != '\0' || blocks > (unsigned int) -1) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    unsigned int new_blocks_count = blocks;
+    
+    disk = read_disk_image_readonly(disk_image_path);
+    
+    unsigned int old_blocks_count = get_blocks_count();
+    unsigned int blocks_per_group = get_super_block()->s_blocks_per_group;
+    
+    if (new_blocks_count < old_blocks_count) {
+        fprintf(stderr, "%s: shrinking is not supported (%u blocks)\n",
+                disk_image_path, old_blocks_count);
+        return EINVAL;
+    }
+    
+    // Only a single block group is supported, and its block bitmap limits
+    // how far the group can grow
+    if (new_blocks_count > blocks_per_group ||
+        new_blocks_count > EXT2_BLOCK_SIZE * CHAR_BIT) {
+        fprintf(stderr, "%s: %u blocks do not fit in one block group\n",
+                disk_image_path, new_blocks_count);
+        return EINVAL;
+    }
+    
+    if (new_blocks_count == old_blocks_count) {
+        printf("%u blocks, nothing to do\n", old_blocks_count);
+        return EXIT_SUCCESS;
+    }
+    
+    // Extend the image file first (as a hole), so that it is always at
+    // least as large as the file system it holds
+    if (truncate(disk_image_path,
+                 (off_t) new_blocks_count * EXT2_BLOCK_SIZE) != 0) {
+        perror("truncate - Could not extend disk image");
+        return errno;
+    }
+    
+    // Map the image again, writable and at its new size
+    close_disk_image();
+    disk = read_disk_image(disk_image_path);
+    
+    grow_file_system(old_blocks_count, new_blocks_count);
+    
+    printf("%u blocks, %u free\n", new_blocks_count,
+           get_super_block()->s_free_blocks_count);
+    
+    return EXIT_SUCCESS;
+    
+}
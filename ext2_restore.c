@@ -1,14 +1,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fnmatch.h>
 
 #include "ext2_utils.h"
 
 
-#define USAGE "Usage: %s <image file name> <absolute path on ext2 image>\n"
+#define USAGE "Usage: %s <image file name> <absolute path on ext2 image>\n"\
+              "       %s <image file name> --scan [--restore] [<path pattern>]\n"\
+              "       %s <image file name> --carve [--restore]\n"
+
+#define SCAN_FLAG "--scan"
+#define RESTORE_FLAG "--restore"
+#define CARVE_FLAG "--carve"
+
+// Directory that carved inodes are linked into
+#define LOST_FOUND_DIR "lost+found"
 
 #define NUM_ARGUMENT_V 3
 
+// Outcomes of visiting a deleted entry during a scan
+#define SCAN_CONTINUE 0
+#define SCAN_STOP 1
+#define SCAN_UNHIDDEN 2
+
+// Longest name given to a directory without a known name ("#" and number)
+#define MAX_INODE_NAME_LEN 16
+
 unsigned char *disk = NULL;
 
 
@@ -134,19 +152,10 @@ int is_inode_and_data_blocks_free(unsigned int inode_num) {
 
 
 /*
- * Reacquires the given inode and all of its data blocks, if they are not
- * already in use.
- *
- * Returns EXIT_SUCCESS if they were successfully acquired.
- * Returns ENOENT, otherwise.
+ * Marks the given (free) inode and all of its data blocks as in-use again,
+ * and makes the inode a live file with a single link.
  */
-int reclaim_inode_and_data_blocks(unsigned int inode_num) {
-    
-    // Return error if the inode and all of its
-    // pointed blocks are not free
-    if (!is_inode_and_data_blocks_free(inode_num)) {
-        return ENOENT;
-    }
+void claim_inode_and_data_blocks(unsigned int inode_num) {
     
     struct ext2_inode *inode = get_inode_table() + INDEX(inode_num);
     
@@ -161,7 +170,7 @@ int reclaim_inode_and_data_blocks(unsigned int inode_num) {
         int block_num = inode->i_block[n];
         
         if (block_num == UNDEFINED) {
-            return EXIT_SUCCESS;
+            return;
         }
         
         set_block_in_use(block_num);
@@ -193,7 +202,26 @@ int reclaim_inode_and_data_blocks(unsigned int inode_num) {
             blocks_claimed++;
         }
     }
+}
+
 
+/*
+ * Reacquires the given inode and all of its data blocks, if they are not
+ * already in use.
+ *
+ * Returns EXIT_SUCCESS if they were successfully acquired.
+ * Returns ENOENT, otherwise.
+ */
+int reclaim_inode_and_data_blocks(unsigned int inode_num) {
+    
+    // Return error if the inode and all of its
+    // pointed blocks are not free
+    if (!is_inode_and_data_blocks_free(inode_num)) {
+        return ENOENT;
+    }
+    
+    claim_inode_and_data_blocks(inode_num);
+    
     return EXIT_SUCCESS;
 }
 
@@ -216,25 +244,30 @@ void unhide_deleted_entry(struct ext2_dir_entry *entry,
 
 
 /*
- * Restores the file with the given `name` that is contained within the
- * directory with the given inode.
+ * Called for each deleted entry found in the gaps of a directory block,
+ * along with the last entry in use before it (which hides it).
  *
- * Returns: EXIT_SUCCESS, if the file was successfully restored
- *                EEXIST, if the file / direcotry already exists
- *                ENOENT, if the file cannot be restored
- *                EISDIR, if the 'file' is a deleted directory
+ * Returns SCAN_CONTINUE to keep scanning, SCAN_UNHIDDEN if the entry was
+ * restored into the directory, or SCAN_STOP to end the scan.
  */
-int restore_file(unsigned int dir_inode_num, char *name) {
+typedef int (*deleted_entry_visitor)(unsigned int dir_inode_num,
+                                     struct ext2_dir_entry *entry,
+                                     struct ext2_dir_entry *prev_entry,
+                                     void *arg);
+
+
+/*
+ * Walks the gaps left by deleted entries in every block of the directory
+ * with the given inode, and calls `visit` for each deleted entry found.
+ *
+ * Returns SCAN_STOP if the visitor ended the scan, SCAN_CONTINUE otherwise.
+ */
+int scan_deleted_entries(unsigned int dir_inode_num,
+                         deleted_entry_visitor visit, void *arg) {
     
     struct ext2_inode *dir_inode = get_inode_table() + INDEX(dir_inode_num);
-    int name_length = get_name_len(name);
-    
-    // Check if the file already exists
-    if (find_entry(dir_inode, name) != NULL) {
-        return EEXIST;
-    }
     
-    // Iterate over data blocks in search for the matching directory entry
+    // Iterate over data blocks in search for deleted directory entries
     int n;
     for (n = 0; n < NUM_DIRECT_PTRS && (dir_inode->i_block)[n] != 0; n++) {
         
@@ -253,6 +286,12 @@ int restore_file(unsigned int dir_inode_num, char *name) {
         struct ext2_dir_entry *last_valid_entry= (struct ext2_dir_entry *)pos;
         
         while (pos < block_end) {
+            
+            // A zeroed-out rec_len would never move past this entry
+            if (last_valid_entry->rec_len == 0) {
+                break;
+            }
+            
             unsigned char *gap_start =
                              pos + get_actual_dir_entry_len(last_valid_entry);
                              
@@ -284,32 +323,21 @@ int restore_file(unsigned int dir_inode_num, char *name) {
                     }
                 }
                 else {
-                    // Check if this is the file we are trying to recover
-                    if (name_length == entry->name_len &&
-                        strncmp(name, entry->name, name_length) == 0) {
-                        
-                        // Do not allow restore of directories
-                        if (entry->file_type == EXT2_FT_DIR) {
-                            return EISDIR;
-                        }
-                        
-                        // Found the correct entry, reclaim inode and
-                        // data blocks, if possible
-                        int result = reclaim_inode_and_data_blocks(entry->inode);
-                        
-                        if (result == EXIT_SUCCESS) {
-                            // Adjust directory entry pointers to 'unhide' the
-                            // deleted entry
-                            unhide_deleted_entry(entry, last_valid_entry);
-                        }
-                        
-                        return result;
+                    int result = visit(dir_inode_num, entry, last_valid_entry,
+                                       arg);
+                    
+                    if (result == SCAN_STOP) {
+                        return SCAN_STOP;
                     }
                     
-                    // Skip to the next entry
-                    else {
-                        pos += get_actual_dir_entry_len(entry);
+                    // The rest of this gap is now the restored entry's gap,
+                    // and is scanned after it
+                    if (result == SCAN_UNHIDDEN) {
+                        break;
                     }
+                    
+                    // Skip to the next entry
+                    pos += get_actual_dir_entry_len(entry);
                 }
             }
             
@@ -318,11 +346,483 @@ int restore_file(unsigned int dir_inode_num, char *name) {
             last_valid_entry = (struct ext2_dir_entry *)
                                 (((unsigned char *) last_valid_entry) +
                                              last_valid_entry->rec_len);
+            pos = (unsigned char *) last_valid_entry;
+        }
+    }
+    
+    return SCAN_CONTINUE;
+}
+
+
+/*
+ * An inode inside a deleted directory tree, found while restoring the tree.
+ */
+struct restore_node {
+    unsigned int inode_num;
+    unsigned int parent_inode_num;  // Directory that contains its entry
+    struct ext2_dir_entry *entry;   // Entry that refers to it
+    int recoverable;
+    int relinkable;                 // Inode still (or again) in use
+};
+
+
+/*
+ * A block referred to by one of the nodes being checked.
+ */
+struct node_block {
+    unsigned int block_num;
+    int node;                       // Index of the node that refers to it
+};
+
+
+int compare_node_blocks(const void *a, const void *b) {
+    struct node_block *x = (struct node_block *) a;
+    struct node_block *y = (struct node_block *) b;
+    
+    return (x->block_num > y->block_num) - (x->block_num < y->block_num);
+}
+
+
+/*
+ * Appends the blocks the given inode refers to (including its indirect
+ * block) to `blocks`, tagged with `node`.
+ *
+ * Returns the new number of blocks, or -1 if the inode refers to a block
+ * past the end of the disk.
+ */
+int add_node_blocks(struct ext2_inode *inode, int node,
+                    struct node_block *blocks, int num_blocks) {
+    
+    unsigned int blocks_count = get_blocks_count();
+    unsigned int n;
+    
+    for (n = 0; n < NUM_DIRECT_PTRS + NUM_INDIRECT_PTRS &&
+                inode->i_block[n] != UNDEFINED; n++) {
+        
+        if (inode->i_block[n] >= blocks_count) {
+            return -1;
+        }
+        blocks[num_blocks].block_num = inode->i_block[n];
+        blocks[num_blocks++].node = node;
+    }
+    
+    if (n <= NUM_DIRECT_PTRS) {
+        return num_blocks;
+    }
+    
+    unsigned int *indirect_block = (unsigned int *)
+                            BLOCK_START(disk, inode->i_block[NUM_DIRECT_PTRS]);
+    
+    for (n = 0; n < NUM_PTRS_PER_BLOCK && indirect_block[n] != UNDEFINED;
+         n++) {
+        
+        if (indirect_block[n] >= blocks_count) {
+            return -1;
+        }
+        blocks[num_blocks].block_num = indirect_block[n];
+        blocks[num_blocks++].node = node;
+    }
+    
+    return num_blocks;
+}
+
+
+/*
+ * Returns TRUE if the given entry inside a deleted tree refers to a file
+ * whose inode survived the deletion, since it had other (hard) links: the
+ * inode is in use, of the type of the entry, and has not been changed (or
+ * reallocated) since the tree was deleted at `deleted_at`. Inodes restored
+ * earlier by the same restore (`seen`) can be linked again as well.
+ */
+int is_relinkable(struct restore_node *node, unsigned char *seen,
+                  unsigned int deleted_at) {
+    
+    struct ext2_inode *inode = get_inode_table() + INDEX(node->inode_num);
+    
+    if (node->entry->file_type == EXT2_FT_DIR) {
+        return FALSE;
+    }
+    
+    if (seen[INDEX(node->inode_num)]) {
+        return TRUE;
+    }
+    
+    if (!is_inode_in_use(node->inode_num) || inode->i_links_count == 0 ||
+        inode->i_ctime > deleted_at) {
+        return FALSE;
+    }
+    
+    return (node->entry->file_type == EXT2_FT_REG_FILE &&
+            IS_REG_FILE(inode->i_mode)) ||
+           (node->entry->file_type == EXT2_FT_SYMLINK &&
+            IS_SYMLINK(inode->i_mode));
+}
+
+
+/*
+ * Decides which of the given nodes can be restored: the inode must be free,
+ * restored only once, and every block it refers to must be free and not
+ * claimed by another node. The blocks of all nodes are sorted, so that the
+ * block bitmap is consulted once, in a single sweep over its ranges.
+ *
+ * Nodes whose inode is still in use are instead marked relinkable, if they
+ * are hard links to a surviving file (see is_relinkable).
+ */
+void check_recoverable_nodes(struct restore_node *nodes, int num_nodes,
+                             unsigned char *seen, unsigned int deleted_at) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    int max_blocks = MAX_INODE_BLOCKS * num_nodes;
+    
+    struct node_block *blocks = malloc(max_blocks * sizeof(struct node_block));
+    
+    if (blocks == NULL) {
+        exit(ENOMEM);
+    }
+    
+    int num_blocks = 0;
+    int i;
+    
+    for (i = 0; i < num_nodes; i++) {
+        unsigned int inode_num = nodes[i].inode_num;
+        nodes[i].recoverable = FALSE;
+        nodes[i].relinkable = FALSE;
+        
+        if (inode_num == UNDEFINED || inode_num > get_inodes_count()) {
+            continue;
+        }
+        
+        if (seen[INDEX(inode_num)] || is_inode_in_use(inode_num)) {
+            nodes[i].relinkable = is_relinkable(&nodes[i], seen, deleted_at);
+            continue;
+        }
+        
+        int end = add_node_blocks(i_table + INDEX(inode_num), i, blocks,
+                                  num_blocks);
+        
+        if (end >= 0) {
+            num_blocks = end;
+            nodes[i].recoverable = TRUE;
+            seen[INDEX(inode_num)] = TRUE;
+        }
+    }
+    
+    qsort(blocks, num_blocks, sizeof(struct node_block), compare_node_blocks);
+    
+    for (i = 0; i < num_blocks; i++) {
+        
+        // Reused since, or claimed by an earlier node as well
+        if (is_block_in_use(blocks[i].block_num) ||
+            (i > 0 && blocks[i].block_num == blocks[i - 1].block_num)) {
+            nodes[blocks[i].node].recoverable = FALSE;
         }
     }
     
-    // No matching dir entry was found
-    return ENOENT;
+    free(blocks);
+}
+
+
+/*
+ * Restores the deleted directory that `entry` (inside the directory with
+ * inode `dir_inode_num`) refers to, along with the files and directories
+ * inside it. The tree is restored one level at a time. Entries for files
+ * that survived the deletion through another hard link are linked to them
+ * again. The entries of anything else that can no longer be restored are
+ * cleared (and reported), so that they do not refer to inodes that have
+ * been reused.
+ *
+ * Returns EXIT_SUCCESS, if the directory and everything inside it was
+ *                       successfully restored
+ *               ENODATA, if the directory was restored, but some of the
+ *                       entries inside it had to be dropped
+ *               ENOENT, if the directory itself cannot be restored
+ */
+int restore_directory(unsigned int dir_inode_num, struct ext2_dir_entry *entry) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned int inodes_count = get_inodes_count();
+    
+    // Every inode is restored at most once, so each level holds at most
+    // one node per inode
+    unsigned char *seen = calloc(inodes_count, sizeof(unsigned char));
+    struct restore_node *level = malloc(inodes_count *
+                                        sizeof(struct restore_node));
+    struct restore_node *next_level = malloc(inodes_count *
+                                             sizeof(struct restore_node));
+    
+    if (seen == NULL || level == NULL || next_level == NULL) {
+        exit(ENOMEM);
+    }
+    
+    level[0].inode_num = entry->inode;
+    level[0].parent_inode_num = dir_inode_num;
+    level[0].entry = entry;
+    
+    // Files changed after this are not the ones the tree linked to
+    unsigned int deleted_at = UNDEFINED;
+    if (entry->inode != UNDEFINED && entry->inode <= inodes_count) {
+        deleted_at = i_table[INDEX(entry->inode)].i_dtime;
+    }
+    
+    int num_nodes = 1;
+    int num_dropped = 0;
+    int result = EXIT_SUCCESS;
+    
+    while (num_nodes > 0) {
+        
+        check_recoverable_nodes(level, num_nodes, seen, deleted_at);
+        
+        // The directory itself must be restorable, or nothing is touched
+        if (level[0].entry == entry && !level[0].recoverable) {
+            result = ENOENT;
+            break;
+        }
+        
+        int num_next = 0;
+        int i;
+        
+        for (i = 0; i < num_nodes; i++) {
+            struct restore_node *node = &level[i];
+            
+            // A hard link to a file that is (still) in use
+            if (node->relinkable && is_inode_in_use(node->inode_num)) {
+                i_table[INDEX(node->inode_num)].i_links_count++;
+                mark_inode_dirty(node->inode_num);
+                continue;
+            }
+            
+            if (!node->recoverable) {
+                fprintf(stderr, "%.*s: inode %u or its blocks have been "\
+                        "reused, entry dropped\n", node->entry->name_len,
+                        node->entry->name, node->inode_num);
+                node->entry->inode = UNDEFINED;
+                num_dropped++;
+                continue;
+            }
+            
+            struct ext2_inode *inode = i_table + INDEX(node->inode_num);
+            struct ext2_inode *parent_inode = i_table +
+                                            INDEX(node->parent_inode_num);
+            
+            claim_inode_and_data_blocks(node->inode_num);
+            
+            if (!IS_DIR(inode->i_mode)) {
+                continue;
+            }
+            
+            // Linked from its entry and its own '.', and from the '..' of
+            // its subdirectories as they are restored
+            inode->i_links_count = 2;
+            parent_inode->i_links_count++;
+            get_group_descriptor()->bg_used_dirs_count++;
+            mark_inode_dirty(node->parent_inode_num);
+            
+            // Its entries are intact, queue them for the next level
+            int n;
+            for (n = 0; n < NUM_DIRECT_PTRS && inode->i_block[n] != 0; n++) {
+                
+                unsigned char *pos = BLOCK_START(disk, inode->i_block[n]);
+                unsigned char *block_end = BLOCK_END(pos);
+                
+                while (pos < block_end) {
+                    struct ext2_dir_entry *child = (struct ext2_dir_entry *) pos;
+                    
+                    if (child->rec_len == 0) {
+                        break;
+                    }
+                    pos += child->rec_len;
+                    
+                    if (child->inode == UNDEFINED ||
+                        is_self_or_parent_entry(child)) {
+                        continue;
+                    }
+                    
+                    // Anything past one node per inode is restored twice
+                    if (num_next == inodes_count) {
+                        child->inode = UNDEFINED;
+                        continue;
+                    }
+                    
+                    next_level[num_next].inode_num = child->inode;
+                    next_level[num_next].parent_inode_num = node->inode_num;
+                    next_level[num_next].entry = child;
+                    num_next++;
+                }
+            }
+        }
+        
+        struct restore_node *tmp = level;
+        level = next_level;
+        next_level = tmp;
+        num_nodes = num_next;
+    }
+    
+    if (result == EXIT_SUCCESS && num_dropped > 0) {
+        result = ENODATA;
+    }
+    
+    free(seen);
+    free(level);
+    free(next_level);
+    
+    return result;
+}
+
+
+/*
+ * Reclaims the inode and data blocks of the given deleted `entry`, and
+ * unhides it in its directory. A deleted directory is restored along with
+ * everything inside it.
+ *
+ * Returns EXIT_SUCCESS, if the file was successfully restored
+ *               ENODATA, if a directory was restored without some of the
+ *                       entries inside it
+ *               ENOENT, if the file cannot be restored
+ */
+int restore_entry(unsigned int dir_inode_num, struct ext2_dir_entry *entry,
+                  struct ext2_dir_entry *prev_entry) {
+    
+    int result;
+    
+    // Reclaim inode and data blocks, if possible
+    if (entry->file_type == EXT2_FT_DIR) {
+        result = restore_directory(dir_inode_num, entry);
+    }
+    else {
+        result = reclaim_inode_and_data_blocks(entry->inode);
+    }
+    
+    // A directory is restored even if some of its entries were dropped
+    if (result == EXIT_SUCCESS || result == ENODATA) {
+        // Adjust directory entry pointers to 'unhide' the deleted entry
+        unhide_deleted_entry(entry, prev_entry);
+        mark_inode_dirty(dir_inode_num);
+    }
+    
+    return result;
+}
+
+
+/*
+ * The file restore_file() is looking for, and the outcome.
+ */
+struct restore_target {
+    char *name;
+    int name_len;
+    int result;
+};
+
+
+int restore_matching_entry(unsigned int dir_inode_num,
+                           struct ext2_dir_entry *entry,
+                           struct ext2_dir_entry *prev_entry, void *arg) {
+    
+    struct restore_target *target = (struct restore_target *) arg;
+    
+    // Check if this is the file we are trying to recover
+    if (target->name_len != entry->name_len ||
+        strncmp(target->name, entry->name, target->name_len) != 0) {
+        return SCAN_CONTINUE;
+    }
+    
+    target->result = restore_entry(dir_inode_num, entry, prev_entry);
+    
+    return SCAN_STOP;
+}
+
+
+/*
+ * Restores the file with the given `name` inside the directory with the
+ * given inode from its tombstone, with a new entry. The inode must still
+ * have the block map it had when the file was deleted, or it has been
+ * reused since.
+ *
+ * Returns: EXIT_SUCCESS, if the file was successfully restored
+ *                ENOENT, if there is no usable tombstone for it
+ *               ENODATA, if a directory was restored without some of the
+ *                        entries inside it
+ */
+int restore_from_tombstone(unsigned int dir_inode_num, char *name) {
+    
+    struct tombstone tomb;
+    int slot = find_tombstone(dir_inode_num, name, &tomb);
+    
+    if (slot < 0 || tomb.inode_num > get_inodes_count()) {
+        return ENOENT;
+    }
+    
+    struct ext2_inode *i_table = get_inode_table();
+    struct ext2_inode *inode = i_table + INDEX(tomb.inode_num);
+    struct ext2_inode *dir_inode = i_table + INDEX(dir_inode_num);
+    
+    if (memcmp(inode->i_block, tomb.blocks, sizeof(tomb.blocks)) != 0 ||
+        !is_inode_and_data_blocks_free(tomb.inode_num)) {
+        return ENOENT;
+    }
+    
+    int result = EXIT_SUCCESS;
+    
+    if (tomb.file_type != EXT2_FT_DIR) {
+        claim_inode_and_data_blocks(tomb.inode_num);
+        
+        // The new entry is the only link to the inode
+        inode->i_links_count = 0;
+        create_dir_entry(dir_inode, tomb.inode_num, name, tomb.file_type);
+    }
+    else {
+        struct ext2_dir_entry *entry = create_dir_entry(dir_inode,
+                                                        tomb.inode_num, name,
+                                                        tomb.file_type);
+        
+        result = restore_directory(dir_inode_num, entry);
+        
+        // Nothing was touched if the directory itself cannot be restored
+        if (result == ENOENT) {
+            entry->inode = UNDEFINED;
+            inode->i_links_count = 0;
+            return ENOENT;
+        }
+    }
+    
+    clear_tombstone(slot);
+    
+    return result;
+}
+
+
+/*
+ * Restores the file with the given `name` that is contained within the
+ * directory with the given inode. The tombstone left by ext2_rm is used if
+ * there is one; otherwise the gaps of the directory are searched for the
+ * deleted entry.
+ *
+ * Returns: EXIT_SUCCESS, if the file was successfully restored
+ *                EEXIST, if the file / direcotry already exists
+ *                ENOENT, if the file cannot be restored
+ *               ENODATA, if a directory was restored without some of the
+ *                        entries inside it
+ */
+int restore_file(unsigned int dir_inode_num, char *name) {
+    
+    struct ext2_inode *dir_inode = get_inode_table() + INDEX(dir_inode_num);
+    
+    // Check if the file already exists
+    if (find_entry(dir_inode, name) != NULL) {
+        return EEXIST;
+    }
+    
+    int result = restore_from_tombstone(dir_inode_num, name);
+    
+    if (result != ENOENT) {
+        return result;
+    }
+    
+    // No matching dir entry is found, unless the scan says otherwise
+    struct restore_target target = { name, get_name_len(name), ENOENT };
+    
+    scan_deleted_entries(dir_inode_num, restore_matching_entry, &target);
+    
+    return target.result;
 }
 
 
@@ -332,7 +832,9 @@ int restore_file(unsigned int dir_inode_num, char *name) {
  * Returns: EXIT_SUCCESS, if the file was successfully restored
  *                EEXIST, if the file / direcotry already exists
  *                ENOENT, if the file cannot be restored
- *                EISDIR, if the 'file' is a deleted directory
+ *               ENODATA, if a directory was restored without some of the
+ *                        entries inside it
+ *                EISDIR, if the path ends in a '/'
  */
 int restore(char *path) {
     // The directory which contains the file to delete
@@ -354,14 +856,439 @@ int restore(char *path) {
 }
 
 
+/*
+ * Returns the entry in use that refers to the inode `inode_num` inside the
+ * directory with the given inode, other than "." and "..", or NULL.
+ */
+struct ext2_dir_entry *find_entry_by_inode(unsigned int dir_inode_num,
+                                           unsigned int inode_num) {
+    
+    struct ext2_inode *dir_inode = get_inode_table() + INDEX(dir_inode_num);
+    
+    int n;
+    for (n = 0; n < NUM_DIRECT_PTRS && (dir_inode->i_block)[n] != 0; n++) {
+        
+        unsigned char *block_start = BLOCK_START(disk, (dir_inode->i_block)[n]);
+        unsigned char *block_end = BLOCK_END(block_start);
+        unsigned char *pos = block_start;
+        
+        while (pos < block_end) {
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *) pos;
+            
+            if (entry->rec_len == 0) {
+                break;
+            }
+            
+            if (entry->inode == inode_num && !is_self_or_parent_entry(entry)) {
+                return entry;
+            }
+            
+            pos += entry->rec_len;
+        }
+    }
+    
+    return NULL;
+}
+
+
+/*
+ * Options and totals of a scan for deleted entries.
+ */
+struct scan_options {
+    char *pattern;              // Only entries whose path matches, if set
+    int restore;                // Whether matching entries are restored
+    char *dir_path;             // Path of the directory being scanned
+    int num_found;
+    int num_restored;
+};
+
+
+/*
+ * Finds the name of the directory with the given inode by looking for its
+ * entry in its parent, and writes the absolute path of the directory into
+ * `path`. A directory whose chain of parents does not lead to the root is
+ * named after the inode it was traced back to, as in "#12/sub".
+ */
+void get_dir_path(unsigned int dir_inode_num, char *path, int size) {
+    
+    unsigned int root_inode_num = NUM(EXT2_ROOT_INO_IDX);
+    int max_depth = get_inodes_count();
+    
+    // The path is built backwards, from the end of the buffer
+    char *start = path + size - 1;
+    *start = '\0';
+    
+    unsigned int inode_num = dir_inode_num;
+    int depth;
+    
+    for (depth = 0; inode_num != root_inode_num && depth < max_depth;
+         depth++) {
+        
+        struct ext2_dir_entry *parent_entry =
+                            find_entry_in_inode(inode_num, PARENT_DIR);
+        struct ext2_dir_entry *entry = NULL;
+        
+        if (parent_entry != NULL && parent_entry->inode != inode_num &&
+            parent_entry->inode <= get_inodes_count()) {
+            entry = find_entry_by_inode(parent_entry->inode, inode_num);
+        }
+        
+        // Lost track of the parent, name the path after this inode
+        if (entry == NULL) {
+            char name[MAX_INODE_NAME_LEN];
+            int len = snprintf(name, sizeof(name), "#%u", inode_num);
+            
+            if (start - path > len) {
+                start -= len;
+                memcpy(start, name, len);
+            }
+            break;
+        }
+        
+        if (start - path <= entry->name_len + 1) {
+            break;
+        }
+        
+        start -= entry->name_len;
+        memcpy(start, entry->name, entry->name_len);
+        *(--start) = DIR_DELIMITER_CHAR;
+        
+        inode_num = parent_entry->inode;
+    }
+    
+    if (*start == '\0') {
+        *(--start) = DIR_DELIMITER_CHAR;
+    }
+    
+    memmove(path, start, path + size - start);
+}
+
+
+/*
+ * Prints a deleted entry found by a scan, and restores it if the scan is
+ * told to. Each entry is listed as its path, inode number, deletion time
+ * and status, separated by tabs.
+ */
+int list_deleted_entry(unsigned int dir_inode_num,
+                       struct ext2_dir_entry *entry,
+                       struct ext2_dir_entry *prev_entry, void *arg) {
+    
+    struct scan_options *options = (struct scan_options *) arg;
+    
+    // Leftover bytes that do not make up an entry
+    if (entry->inode > get_inodes_count() || entry->name_len == 0) {
+        return SCAN_CONTINUE;
+    }
+    
+    char path[EXT2_BLOCK_SIZE * 2];
+    snprintf(path, sizeof(path), "%s%s%.*s", options->dir_path,
+             (strcmp(options->dir_path, DIR_DELIMITER) == 0) ? "" :
+                                                              DIR_DELIMITER,
+             entry->name_len, entry->name);
+    
+    if (options->pattern != NULL &&
+        fnmatch(options->pattern, path, FNM_PATHNAME) != 0) {
+        return SCAN_CONTINUE;
+    }
+    
+    struct ext2_inode *dir_inode = get_inode_table() + INDEX(dir_inode_num);
+    
+    // Restoring the entry clears its deletion time
+    unsigned int dtime = (get_inode_table() + INDEX(entry->inode))->i_dtime;
+    
+    char name[EXT2_NAME_LEN + 1];
+    strncpy(name, entry->name, entry->name_len);
+    name[entry->name_len] = '\0';
+    
+    char *status;
+    int result = SCAN_CONTINUE;
+    
+    if (find_entry(dir_inode, name) != NULL) {
+        status = "name in use";
+    }
+    else if (!is_inode_and_data_blocks_free(entry->inode)) {
+        status = "unrecoverable";
+    }
+    else {
+        status = "recoverable";
+        
+        int restored = options->restore ?
+                       restore_entry(dir_inode_num, entry, prev_entry) :
+                       ENOENT;
+        
+        // Entries dropped from inside a restored directory were reported
+        if (restored == EXIT_SUCCESS || restored == ENODATA) {
+            status = (restored == EXIT_SUCCESS) ? "restored" :
+                                                  "partly restored";
+            result = SCAN_UNHIDDEN;
+            options->num_restored++;
+        }
+    }
+    
+    printf("%s\t%u\t%u\t%s\n", path, entry->inode, dtime, status);
+    options->num_found++;
+    
+    return result;
+}
+
+
+/*
+ * Scans the blocks of every directory in use, in a single pass, for
+ * deleted entries, and lists them. If `restore` is set, every entry that
+ * is still recoverable (and matches `pattern`, if given) is restored.
+ *
+ * Returns EXIT_SUCCESS, or ENOENT if no matching entry was found.
+ */
+int scan_image(char *pattern, int restore) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned int inodes_count = get_inodes_count();
+    
+    char dir_path[EXT2_BLOCK_SIZE];
+    struct scan_options options = { pattern, restore, dir_path, 0, 0 };
+    
+    unsigned int inode_num;
+    for (inode_num = NUM(0); inode_num <= inodes_count; inode_num++) {
+        struct ext2_inode *inode = i_table + INDEX(inode_num);
+        
+        if (!is_inode_in_use(inode_num) || !IS_DIR(inode->i_mode)) {
+            continue;
+        }
+        
+        get_dir_path(inode_num, dir_path, sizeof(dir_path));
+        scan_deleted_entries(inode_num, list_deleted_entry, &options);
+    }
+    
+    if (restore) {
+        fprintf(stderr, "%d of %d deleted entries restored\n",
+                options.num_restored, options.num_found);
+    }
+    
+    return (options.num_found > 0) ? EXIT_SUCCESS : ENOENT;
+}
+
+
+/*
+ * Sorts inodes by deletion time, most recent first, and then by inode
+ * number.
+ */
+int compare_dtimes(const void *a, const void *b) {
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned int x = *((unsigned int *) a);
+    unsigned int y = *((unsigned int *) b);
+    
+    unsigned int x_dtime = i_table[INDEX(x)].i_dtime;
+    unsigned int y_dtime = i_table[INDEX(y)].i_dtime;
+    
+    if (x_dtime != y_dtime) {
+        return (x_dtime < y_dtime) - (x_dtime > y_dtime);
+    }
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Returns the inode number of /lost+found, creating the directory if it
+ * does not exist yet, or UNDEFINED if there is a non-directory by that name.
+ */
+unsigned int get_lost_found_dir() {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    struct ext2_inode *root_inode = i_table + EXT2_ROOT_INO_IDX;
+    unsigned int root_inode_num = NUM(EXT2_ROOT_INO_IDX);
+    
+    struct ext2_dir_entry *entry = find_entry(root_inode, LOST_FOUND_DIR);
+    
+    if (entry != NULL) {
+        return (entry->file_type == EXT2_FT_DIR) ? entry->inode : UNDEFINED;
+    }
+    
+    entry = create_dir_entry(root_inode, UNDEFINED, LOST_FOUND_DIR,
+                             EXT2_FT_DIR);
+    get_group_descriptor()->bg_used_dirs_count++;
+    
+    unsigned int lost_found_num = entry->inode;
+    struct ext2_inode *lost_found = i_table + INDEX(lost_found_num);
+    
+    create_dir_entry(lost_found, lost_found_num, CURRENT_DIR, EXT2_FT_DIR);
+    create_dir_entry(lost_found, root_inode_num, PARENT_DIR, EXT2_FT_DIR);
+    
+    return lost_found_num;
+}
+
+
+/*
+ * Marks the blocks of the given inode in `claimed`, unless one of them has
+ * already been claimed by another carved inode.
+ *
+ * Returns TRUE if the blocks were claimed, or FALSE if any of them were
+ * already taken.
+ */
+int claim_carved_blocks(struct ext2_inode *inode, unsigned char *claimed) {
+    
+    unsigned int blocks[MAX_INODE_BLOCKS];
+    int num_blocks = collect_inode_blocks(inode, blocks);
+    
+    int i;
+    for (i = 0; i < num_blocks; i++) {
+        if (claimed[blocks[i]]) {
+            return FALSE;
+        }
+    }
+    
+    for (i = 0; i < num_blocks; i++) {
+        claimed[blocks[i]] = TRUE;
+    }
+    
+    return TRUE;
+}
+
+
+/*
+ * Finds deleted files whose inode survived, even though no directory entry
+ * for them can be found any more: inodes that are free, but still have a
+ * deletion time, and whose blocks are all still free. They are listed
+ * most recently deleted first, and if `restore` is set, linked into
+ * /lost+found as '#<inode number>'. A block claimed by two such inodes was
+ * last written by the more recently deleted one, which therefore gets it,
+ * whether the files are restored or only listed.
+ *
+ * Directories are left alone, since their entries can only be trusted when
+ * they are restored from their parent (see restore_directory).
+ *
+ * Returns EXIT_SUCCESS, ENOENT if no such file was found, or ENOTDIR if
+ * /lost+found is not a directory.
+ */
+int carve_inodes(int restore) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    
+    unsigned int *inode_nums = malloc(get_inodes_count() *
+                                      sizeof(unsigned int));
+    unsigned char *claimed = calloc(get_blocks_count(),
+                                    sizeof(unsigned char));
+    
+    if (inode_nums == NULL || claimed == NULL) {
+        exit(ENOMEM);
+    }
+    
+    int num_deleted = collect_deleted_inodes(inode_nums);
+    int num_carved = 0;
+    
+    qsort(inode_nums, num_deleted, sizeof(unsigned int), compare_dtimes);
+    
+    unsigned int lost_found_num = UNDEFINED;
+    
+    int i;
+    for (i = 0; i < num_deleted; i++) {
+        unsigned int inode_num = inode_nums[i];
+        struct ext2_inode *inode = i_table + INDEX(inode_num);
+        
+        // Reserved inodes, directories and blank inodes are skipped
+        if (inode_num < get_super_block()->s_first_ino ||
+            !(IS_REG_FILE(inode->i_mode) || IS_SYMLINK(inode->i_mode)) ||
+            !is_inode_and_data_blocks_free(inode_num) ||
+            !claim_carved_blocks(inode, claimed)) {
+            continue;
+        }
+        
+        char name[MAX_INODE_NAME_LEN];
+        snprintf(name, sizeof(name), "#%u", inode_num);
+        
+        unsigned int dtime = inode->i_dtime;
+        char *status = "recoverable";
+        
+        if (restore && lost_found_num == UNDEFINED) {
+            lost_found_num = get_lost_found_dir();
+            
+            if (lost_found_num == UNDEFINED) {
+                free(inode_nums);
+                free(claimed);
+                return ENOTDIR;
+            }
+        }
+        
+        if (restore) {
+            unsigned char file_type = IS_REG_FILE(inode->i_mode) ?
+                                        EXT2_FT_REG_FILE : EXT2_FT_SYMLINK;
+            
+            claim_inode_and_data_blocks(inode_num);
+            
+            // The new entry is the only link to the inode
+            inode->i_links_count = 0;
+            create_dir_entry(i_table + INDEX(lost_found_num), inode_num, name,
+                             file_type);
+            status = "restored";
+        }
+        
+        printf("%s%s%s%s\t%u\t%u\t%s\n", DIR_DELIMITER, LOST_FOUND_DIR,
+               DIR_DELIMITER, name, inode_num, dtime, status);
+        num_carved++;
+    }
+    
+    free(inode_nums);
+    free(claimed);
+    
+    return (num_carved > 0) ? EXIT_SUCCESS : ENOENT;
+}
+
+
 int main(int argc, char *argv[]) {
     
-    if (argc != NUM_ARGUMENT_V) {
-        fprintf(stderr, USAGE, argv[0]);
+    if (argc < NUM_ARGUMENT_V) {
+        fprintf(stderr, USAGE, argv[0], argv[0], argv[0]);
         return EXIT_FAILURE;
     }
     
     char *disk_image_path = argv[1];
+    
+    if (strcmp(argv[2], SCAN_FLAG) == 0) {
+        int restore_all = FALSE;
+        char *pattern = NULL;
+        
+        int i;
+        for (i = 3; i < argc; i++) {
+            if (strcmp(argv[i], RESTORE_FLAG) == 0) {
+                restore_all = TRUE;
+            }
+            else if (pattern == NULL) {
+                pattern = argv[i];
+            }
+            else {
+                fprintf(stderr, USAGE, argv[0], argv[0], argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        
+        disk = read_disk_image(disk_image_path);
+        
+        return scan_image(pattern, restore_all);
+    }
+    
+    if (strcmp(argv[2], CARVE_FLAG) == 0) {
+        int restore_all = FALSE;
+        
+        if (argc > NUM_ARGUMENT_V + 1 ||
+            (argc == NUM_ARGUMENT_V + 1 &&
+             strcmp(argv[3], RESTORE_FLAG) != 0)) {
+            fprintf(stderr, USAGE, argv[0], argv[0], argv[0]);
+            return EXIT_FAILURE;
+        }
+        
+        if (argc == NUM_ARGUMENT_V + 1) {
+            restore_all = TRUE;
+        }
+        
+        disk = read_disk_image(disk_image_path);
+        
+        return carve_inodes(restore_all);
+    }
+    
+    if (argc != NUM_ARGUMENT_V) {
+        fprintf(stderr, USAGE, argv[0], argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+    
     char *file_path = argv[2];
     
     disk = read_disk_image(disk_image_path);
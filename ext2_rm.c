@@ -5,74 +5,108 @@
 #include "ext2_utils.h"
 
 
-#define USAGE "Usage: %s <image file name> <absolute path on ext2 image>\n"
+#define USAGE "Usage: %s <image file name> [-r] [--discard] "\
+                        "<absolute path on ext2 image>... | -\n"
 
-#define NUM_ARGUMENT_V 3
+#define RECURSIVE_FLAG "-r"
+#define DISCARD_FLAG "--discard"
+
+// Read a null-delimited list of paths from stdin
+#define STDIN_PATHS "-"
+
+#define MIN_ARGUMENT_V 3
 
 unsigned char *disk = NULL;
 
 
 /*
- * Returns the directory entry for the directory that contains the file
- * with the given `file_path`.
+ * Finds the directory that contains the file with the given path, which is
+ * tokenized in place, and sets `name` to the name of the file within it (or
+ * to NULL, if the path refers to the root directory). Only the directories
+ * along the path are looked up; the file itself is left for the single pass
+ * over its directory.
+ *
+ * The leading directories that `path` shares with the previous path are
+ * taken from `prefix`, and `prefix` is updated to hold those of `path`.
+ *
+ * Returns the inode number of the directory, or UNDEFINED if one of the
+ * directories along the path does not exist.
  */
-struct ext2_dir_entry *find_container_directory(char *file_path) {
+unsigned int find_parent_directory(char *path, char **name,
+                                   struct resolved_prefix *prefix) {
     
-    // Length of path (including null byte)
-    int path_len = strlen(file_path) + 1;
+    // A path has at most one component per two characters ("/a")
+    int max_depth = strlen(path) / 2 + 1;
+    char **names = malloc(max_depth * sizeof(char *));
+    unsigned int *inodes = malloc(max_depth * sizeof(unsigned int));
     
-    char tokenized_path[path_len];
-    strncpy(tokenized_path, file_path, path_len);
-    
-    // The name of the current dir / file / link in the path
-    char *token = strtok(tokenized_path, DIR_DELIMITER);
+    if (names == NULL || inodes == NULL) {
+        exit(ENOMEM);
+    }
     
-    unsigned int root_inode_num = NUM(EXT2_ROOT_INO_IDX);
+    unsigned int dir_inode_num = NUM(EXT2_ROOT_INO_IDX);
+    int depth = 0;
+    int shared = TRUE;
     
-    // Container (or 'parent') directory of curr_dir_entry
-    struct ext2_dir_entry *container_dir =
-                            find_entry_in_inode(root_inode_num, CURRENT_DIR);
+    *name = NULL;
     
-    // The current directory entry in path
-    struct ext2_dir_entry *curr_dir_entry =
-                            find_entry_in_inode(container_dir->inode, token);
+    char *token = strtok(path, DIR_DELIMITER);
     
     while (token != NULL) {
         char *next_token = strtok(NULL, DIR_DELIMITER);
         
-        // 'file_path' refers to a non-existent entry
-        if (curr_dir_entry == NULL) {
-            exit(ENOENT);
+        // Reached the file itself
+        if (next_token == NULL) {
+            *name = token;
+            break;
         }
         
-        // Reached end of path
-        else if (next_token == NULL) {
-            return container_dir;
+        // Reuse the directory resolved for the previous path
+        if (shared && depth < prefix->depth &&
+            strcmp(prefix->names[depth], token) == 0) {
+            
+            dir_inode_num = prefix->inodes[depth];
         }
-        
-        // One or more entries in th path is not a directory
-        else if (curr_dir_entry->file_type != EXT2_FT_DIR) {
-            exit(ENOENT);
+        else {
+            shared = FALSE;
+            
+            struct ext2_dir_entry *entry = find_entry_in_inode(dir_inode_num,
+                                                               token);
+            
+            // One or more entries in the path does not exist, or is not a
+            // directory
+            if (entry == NULL || entry->file_type != EXT2_FT_DIR) {
+                dir_inode_num = UNDEFINED;
+                break;
+            }
+            
+            dir_inode_num = entry->inode;
         }
         
+        names[depth] = token;
+        inodes[depth] = dir_inode_num;
+        depth++;
+        
         token = next_token;
-        container_dir = curr_dir_entry;
-        curr_dir_entry = find_entry_in_inode(curr_dir_entry->inode, token);
     }
     
-    return container_dir;
+    free(prefix->names);
+    free(prefix->inodes);
+    
+    prefix->names = names;
+    prefix->inodes = inodes;
+    prefix->depth = depth;
+    
+    return dir_inode_num;
 }
 
 
 /*
- * Deletes the given `entry` by making its previous entry point to the
+ * Hides the given `entry` by making its previous entry point to the
  * next valid entry.
  */
-int delete_entry(struct ext2_dir_entry *entry,
-                 struct ext2_dir_entry *prev_entry) {
-    
-    // Unlink inode (and free blocks if inode has no more links)
-    unlink_inode(entry->inode);
+void hide_entry(struct ext2_dir_entry *entry,
+                struct ext2_dir_entry *prev_entry) {
     
     // Set inode to 0 if 'entry' is the first entry in the block
     if (prev_entry == NULL) {
@@ -84,27 +118,241 @@ int delete_entry(struct ext2_dir_entry *entry,
     else {
         prev_entry->rec_len += entry->rec_len;
     }
+}
+
+
+/*
+ * Deletes the given `entry` by making its previous entry point to the
+ * next valid entry.
+ */
+int delete_entry(struct ext2_dir_entry *entry,
+                 struct ext2_dir_entry *prev_entry) {
+    
+    // Unlink inode (and free blocks if inode has no more links)
+    unlink_inode(entry->inode);
+    
+    hide_entry(entry, prev_entry);
+    
+    return EXIT_SUCCESS;
+    
+}
+
+
+/*
+ * Frees the given directory inode and its blocks. Its entries are left
+ * as-is, so that its contents can still be found while it is being deleted.
+ */
+void free_directory_inode(unsigned int inode_num) {
+    
+    struct ext2_inode *inode = get_inode_table() + INDEX(inode_num);
+    
+    // All links to the directory (its entry in the parent, its own '.' and
+    // the '..' of its subdirectories) are deleted along with the tree
+    inode->i_links_count = 0;
+    inode->i_dtime = get_timestamp();
+    
+    free_data_blocks(inode);
+    free_inode(inode_num);
+    
+    get_group_descriptor()->bg_used_dirs_count--;
+}
+
+
+/*
+ * Deletes the directory with the given inode along with everything inside
+ * it. The tree is walked iteratively, using an explicit stack of the
+ * directories that are yet to be emptied. Each directory is visited once,
+ * so a corrupted tree that links a directory twice (or to one of its
+ * ancestors) is neither freed twice nor walked forever.
+ */
+void delete_tree(unsigned int dir_inode_num) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    
+    // Every directory is pushed at most once, since it is only pushed
+    // when first visited
+    int max_dirs = get_inodes_count();
+    unsigned int *pending_dirs = malloc(max_dirs * sizeof(unsigned int));
+    unsigned char *visited = calloc(max_dirs, sizeof(unsigned char));
+    
+    if (pending_dirs == NULL || visited == NULL) {
+        exit(ENOMEM);
+    }
+    
+    int num_pending = 0;
+    pending_dirs[num_pending++] = dir_inode_num;
+    visited[INDEX(dir_inode_num)] = TRUE;
+    
+    while (num_pending > 0) {
+        unsigned int inode_num = pending_dirs[--num_pending];
+        struct ext2_inode *dir_inode = i_table + INDEX(inode_num);
+        
+        int n;
+        for (n = 0; n < NUM_DIRECT_PTRS && (dir_inode->i_block)[n] != 0; n++) {
+            
+            unsigned char *block_start = BLOCK_START(disk,
+                                                     (dir_inode->i_block)[n]);
+            unsigned char *block_end = BLOCK_END(block_start);
+            
+            // Current position within this block
+            unsigned char *pos = block_start;
+            
+            while (pos < block_end) {
+                struct ext2_dir_entry *entry = (struct ext2_dir_entry *) pos;
+                
+                // Dir entry is blank / zeroed out / has invalid rec_len
+                if (entry->rec_len == 0) {
+                    break;
+                }
+                
+                pos += entry->rec_len;
+                
+                if (entry->inode == UNDEFINED ||
+                    is_self_or_parent_entry(entry)) {
+                    continue;
+                }
+                
+                // Empty subdirectories later, unlink everything else now
+                if (entry->file_type == EXT2_FT_DIR) {
+                    if (entry->inode <= max_dirs &&
+                        !visited[INDEX(entry->inode)]) {
+                        visited[INDEX(entry->inode)] = TRUE;
+                        pending_dirs[num_pending++] = entry->inode;
+                    }
+                }
+                else {
+                    unlink_inode(entry->inode);
+                }
+            }
+        }
+        
+        free_directory_inode(inode_num);
+    }
+    
+    free(pending_dirs);
+    free(visited);
+}
+
+
+/*
+ * Deletes the given directory `entry` and everything inside it, and hides
+ * the entry in its parent directory.
+ */
+int delete_dir_entry(unsigned int dir_inode_num,
+                     struct ext2_dir_entry *entry,
+                     struct ext2_dir_entry *prev_entry) {
+    
+    // Never delete a directory through its '.' or '..' entry
+    if (is_self_or_parent_entry(entry)) {
+        return EINVAL;
+    }
+    
+    delete_tree(entry->inode);
+    hide_entry(entry, prev_entry);
+    
+    // The deleted directory's '..' no longer links to the parent
+    (get_inode_table() + INDEX(dir_inode_num))->i_links_count--;
     
     return EXIT_SUCCESS;
+}
+
+
+/*
+ * A file to delete, identified by its name within its parent directory.
+ */
+struct rm_target {
+    char *path;                  // Path as given by the user
+    unsigned int dir_inode_num;  // Directory that contains the file
+    char *name;                  // Name of the file within that directory
+    int name_len;
+    int result;                  // Outcome of deleting the file
+};
+
+
+/*
+ * Orders targets by parent directory, and then by name within each
+ * directory.
+ */
+int compare_targets(const void *a, const void *b) {
+    struct rm_target *x = *((struct rm_target **) a);
+    struct rm_target *y = *((struct rm_target **) b);
+    
+    if (x->dir_inode_num != y->dir_inode_num) {
+        return (x->dir_inode_num > y->dir_inode_num) ? 1 : -1;
+    }
+    if (x->name_len != y->name_len) {
+        return x->name_len - y->name_len;
+    }
+    return strncmp(x->name, y->name, x->name_len);
+}
+
+
+/*
+ * Returns the target (among `num_targets` targets sorted by compare_targets)
+ * whose name matches the given entry, or NULL if there is none.
+ */
+struct rm_target *find_target(struct rm_target **targets, int num_targets,
+                              struct ext2_dir_entry *entry) {
+    int low = 0;
+    int high = num_targets - 1;
+    
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        struct rm_target *target = targets[mid];
+        
+        int order = target->name_len - (int) entry->name_len;
+        if (order == 0) {
+            order = strncmp(target->name, entry->name, target->name_len);
+        }
+        
+        if (order == 0) {
+            return target;
+        }
+        else if (order < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
     
+    return NULL;
 }
 
 
 /*
- * Deletes (i.e. hides) the directory entry for the file with the
- * given `name` that resides inside the directory with inode `dir_inode_num`.
+ * Deletes (i.e. hides) the directory entries for all of the given targets,
+ * which reside inside the directory with inode `dir_inode_num`. The
+ * directory's blocks are scanned a single time, and every matching entry
+ * is deleted as it is met.
  *
- * Returns EXIT_SUCCESS, if the file was successfully deleted.
+ * Directories (and their contents) are only deleted if `recursive` is set.
+ *
+ * Sets the result of each target to
+ *         EXIT_SUCCESS, if the file was successfully deleted.
  *               ENOENT, if the file does not exist.
- *               EISDIR, if the given `path` refers to a directory. 
+ *               EISDIR, if the target refers to a directory.
+ *               EINVAL, if the target is '.' or '..'.
  */
-int delete_file_entry(unsigned int dir_inode_num, char *name) {
+void delete_file_entries(unsigned int dir_inode_num,
+                         struct rm_target **targets, int num_targets,
+                         int recursive) {
     
     struct ext2_inode *dir_inode = get_inode_table() + INDEX(dir_inode_num);
     
-    int name_length = get_name_len(name);
+    int i;
+    for (i = 0; i < num_targets; i++) {
+        targets[i]->result = ENOENT;
+    }
+    
+    // The directory itself was deleted by an earlier (recursive) target
+    if (dir_inode->i_links_count == 0) {
+        return;
+    }
     
-    // Iterate over data blocks in search for the matching directory entry
+    mark_inode_dirty(dir_inode_num);
+    
+    // Iterate over data blocks in search for the matching directory entries
     int n;
     for (n = 0; n < NUM_DIRECT_PTRS && (dir_inode->i_block)[n] != 0; n++) {
         
@@ -119,94 +367,297 @@ int delete_file_entry(unsigned int dir_inode_num, char *name) {
         // The previous entry within the block
         struct ext2_dir_entry *prev_entry = NULL;
 
-        while (pos != block_end) {
+        while (pos < block_end) {
             struct ext2_dir_entry *entry = (struct ext2_dir_entry *) pos;
             
-            // Dir entry is in use
-            if (entry->inode != UNDEFINED) {
-                
-                // Check if length of file names match
-                if (name_length == ((int) entry->name_len)) {
-                    
-                    // File names match
-                    if (strncmp(name, entry->name, name_length) == 0) {
-                        
-                        // Do not allow deletion of directories
-                        if (entry->file_type == EXT2_FT_DIR) {
-                            return EISDIR;
-                        }
-                        
-                        // Delete the entry
-                        return delete_entry(entry, prev_entry);
-                    }
-                }
-                pos += entry->rec_len;
+            // Dir entry is blank / zeroed out / has invalid rec_len
+            if (entry->rec_len == 0) {
+                // Skip to end of block
+                break;
             }
             
-            // Dir entry is not in use. Move to next entry
-            else if (entry->rec_len > 0) {
-                pos += entry->rec_len;
+            pos += entry->rec_len;
+            
+            // Dir entry is in use, check if it is one of the targets
+            struct ext2_dir_entry *match = NULL;
+            struct rm_target *target = NULL;
+            
+            if (entry->inode != UNDEFINED) {
+                target = find_target(targets, num_targets, entry);
             }
             
-            // Dir entry is blank / zeroed out / has invalid rec_len
-            else {
-                // Skip to end of block
-                pos = block_end;
+            if (target != NULL && target->result == ENOENT) {
+                match = entry;
+                
+                // Deleting the first entry of a block clears its inode
+                unsigned int inode_num = entry->inode;
+                
+                // Only delete directories recursively
+                if (entry->file_type == EXT2_FT_DIR && !recursive) {
+                    target->result = EISDIR;
+                }
+                else if (entry->file_type == EXT2_FT_DIR) {
+                    target->result = delete_dir_entry(dir_inode_num, entry,
+                                                      prev_entry);
+                }
+                else {
+                    target->result = delete_entry(entry, prev_entry);
+                }
+                
+                // Leave a tombstone, so that the file can be restored
+                // without searching the directory for its entry
+                if (target->result == EXIT_SUCCESS) {
+                    record_tombstone(dir_inode_num, inode_num, entry->name,
+                                     entry->name_len, entry->file_type);
+                }
             }
             
-            prev_entry = entry;
+            // A deleted entry is merged into its previous entry (unless it
+            // is the first in the block), which stays the previous entry
+            if (match == NULL || target->result != EXIT_SUCCESS ||
+                prev_entry == NULL) {
+                prev_entry = entry;
+            }
         }
     }
-    
-    // No matching dir entry was found
-    return ENOENT;
 }
 
 
 /*
- * Deletes the file with the given `path`.
+ * Finds the directory that contains the file with the given path, and the
+ * name of the file within it. Whether the file exists is only found out
+ * when its directory is scanned.
  *
- * Returns EXIT_SUCCESS, if the file was successfully deleted.
- *               ENOENT, if the file does not exist.
- *               EISDIR, if the given `path` refers to a directory.
+ * Sets the result of the target to ENOENT or EISDIR if the path is invalid.
  */
-int delete_file(char *path) {
+void resolve_target(struct rm_target *target, int recursive,
+                    struct resolved_prefix *prefix) {
+    
+    char *path = target->path;
+    target->result = EXIT_SUCCESS;
     
     // Ensure that file_path starts with a '/'
     if (!IS_PATH_ABSOLUTE(path)) {
-        return ENOENT;
+        target->result = ENOENT;
+        return;
+    }
+    
+    // Tokenize a copy, so that the original path can still be reported
+    int path_len = strlen(path) + 1;
+    char *tokenized_path = malloc(path_len);
+    
+    if (tokenized_path == NULL) {
+        exit(ENOMEM);
     }
+    strncpy(tokenized_path, path, path_len);
     
     // The directory which contains the file to delete
-    struct ext2_dir_entry *container_dir = find_container_directory(path);
+    char *file_name;
+    unsigned int dir_inode_num = find_parent_directory(tokenized_path,
+                                                       &file_name, prefix);
     
-    // Don't accept directory paths
-    if (path[strlen(path) - 1] == DIR_DELIMITER_CHAR) {
-        return EISDIR;
+    if (dir_inode_num == UNDEFINED) {
+        target->result = ENOENT;
+        return;
     }
     
-    char *file_name = get_file_name(path);
+    // Don't accept directory paths
+    if (!recursive && path[strlen(path) - 1] == DIR_DELIMITER_CHAR) {
+        target->result = EISDIR;
+        return;
+    }
     
     // No filname specified implies, it refers to the current dir
     if (file_name == NULL) {
         file_name = CURRENT_DIR;
     }
     
-    return delete_file_entry(container_dir->inode, file_name);
+    target->dir_inode_num = dir_inode_num;
+    target->name = file_name;
+    target->name_len = get_name_len(file_name);
 }
 
+
+/*
+ * Deletes the files with the given paths. If `recursive` is set, the paths
+ * may also refer to directories, which are deleted along with their contents.
+ *
+ * The files are grouped by their parent directory, so that each directory
+ * is only scanned once no matter how many of its files are deleted.
+ *
+ * Returns EXIT_SUCCESS, if all files were successfully deleted.
+ * Otherwise, returns the error for the first path that failed:
+ *               ENOENT, if the file does not exist.
+ *               EISDIR, if the path refers to a directory.
+ *               EINVAL, if the path refers to '.' or '..'.
+ */
+int delete_files(char **paths, int num_paths, int recursive) {
+    
+    struct rm_target *targets = malloc(num_paths * sizeof(struct rm_target));
+    struct rm_target **valid = malloc(num_paths * sizeof(struct rm_target *));
+    
+    if (targets == NULL || valid == NULL) {
+        exit(ENOMEM);
+    }
+    
+    struct resolved_prefix prefix = { NULL, NULL, NULL, 0 };
+    
+    int i, num_valid = 0;
+    for (i = 0; i < num_paths; i++) {
+        targets[i].path = paths[i];
+        resolve_target(&targets[i], recursive, &prefix);
+        
+        if (targets[i].result == EXIT_SUCCESS) {
+            valid[num_valid++] = &targets[i];
+        }
+    }
+    
+    qsort(valid, num_valid, sizeof(struct rm_target *), compare_targets);
+    
+    // Delete the files of each directory in one pass over the directory
+    int group_start = 0;
+    while (group_start < num_valid) {
+        int group_end = group_start + 1;
+        
+        while (group_end < num_valid &&
+               valid[group_end]->dir_inode_num ==
+               valid[group_start]->dir_inode_num) {
+            group_end++;
+        }
+        
+        delete_file_entries(valid[group_start]->dir_inode_num,
+                            valid + group_start, group_end - group_start,
+                            recursive);
+        group_start = group_end;
+    }
+    
+    free(prefix.names);
+    free(prefix.inodes);
+    
+    int result = EXIT_SUCCESS;
+    
+    for (i = 0; i < num_paths; i++) {
+        if (targets[i].result == EXIT_SUCCESS) {
+            continue;
+        }
+        
+        if (num_paths > 1) {
+            fprintf(stderr, "%s: %s\n", targets[i].path,
+                    strerror(targets[i].result));
+        }
+        if (result == EXIT_SUCCESS) {
+            result = targets[i].result;
+        }
+    }
+    
+    return result;
+}
+
+
+/*
+ * Reads a null-delimited list of paths from the given stream.
+ *
+ * Returns the list of paths, and sets `num_paths` to its length.
+ */
+char **read_path_list(FILE *stream, int *num_paths) {
+    
+    size_t len = 0;
+    size_t capacity = EXT2_BLOCK_SIZE;
+    char *buf = malloc(capacity + 1);
+    
+    if (buf == NULL) {
+        exit(ENOMEM);
+    }
+    
+    size_t bytes_read;
+    while ((bytes_read = fread(buf + len, 1, capacity - len, stream)) > 0) {
+        len += bytes_read;
+        
+        if (len == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity + 1);
+            
+            if (buf == NULL) {
+                exit(ENOMEM);
+            }
+        }
+    }
+    
+    // Terminate the last path, in case the list has no trailing delimiter
+    buf[len] = '\0';
+    
+    char **paths = malloc((len + 1) * sizeof(char *));
+    if (paths == NULL) {
+        exit(ENOMEM);
+    }
+    
+    *num_paths = 0;
+    
+    char *pos = buf;
+    while (pos < buf + len) {
+        if (*pos != '\0') {
+            paths[(*num_paths)++] = pos;
+        }
+        pos += strlen(pos) + 1;
+    }
+    
+    return paths;
+}
+
+
 int main(int argc, char *argv[]) {
     
-    if (argc != NUM_ARGUMENT_V) {
+    if (argc < MIN_ARGUMENT_V) {
         fprintf(stderr, USAGE, argv[0]);
         return EXIT_FAILURE;
     }
     
+    int recursive = FALSE;
+    int discard = FALSE;
     char *disk_image_path = argv[1];
-    char *file_path = argv[2];
+    int first_path = 2;
+    
+    // Check if flags for recursive deletion or discarding are present
+    for (; first_path < argc; first_path++) {
+        char *flag = argv[first_path];
+        
+        if (strcmp(flag, RECURSIVE_FLAG) == 0) {
+            recursive = TRUE;
+        }
+        else if (strcmp(flag, DISCARD_FLAG) == 0) {
+            discard = TRUE;
+        }
+        else {
+            break;
+        }
+    }
+    
+    if (first_path >= argc) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    char **paths = argv + first_path;
+    int num_paths = argc - first_path;
+    
+    // Read the paths from stdin instead
+    if (num_paths == 1 && strcmp(paths[0], STDIN_PATHS) == 0) {
+        paths = read_path_list(stdin, &num_paths);
+    }
     
     disk = read_disk_image(disk_image_path);
     
-    return delete_file(file_path);
+    if (discard) {
+        enable_discard();
+    }
+    
+    // Free all released blocks from the bitmap at once
+    begin_block_free_batch();
+    
+    int result = delete_files(paths, num_paths, recursive);
+    
+    end_block_free_batch();
+    
+    return result;
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "ext2_utils.h"
+
+
+#define USAGE "Usage: %s <image file name> [--discard] "\
+                        "<absolute path on ext2 image> <size in bytes>\n"
+
+#define DISCARD_FLAG "--discard"
+
+#define MIN_ARGUMENT_V 4
+#define MAX_ARGUMENT_V 5
+
+unsigned char *disk = NULL;
+
+
+/*
+ * Returns the directory entry for the file referred by the given `path`.
+ */
+struct ext2_dir_entry *find_file_entry(char *path) {
+    
+    // Ensure that path starts with a '/'
+    if (!IS_PATH_ABSOLUTE(path)) {
+        exit(ENOENT);
+    }
+    
+    // Length of path (including null byte)
+    int path_len = strlen(path) + 1;
+    
+    char tokenized_path[path_len];
+    strncpy(tokenized_path, path, path_len);
+    
+    // The name of the current dir / file / link in the path
+    char *token = strtok(tokenized_path, DIR_DELIMITER);
+    
+    // Current Directory Entry in path
+    struct ext2_dir_entry *curr_dir_entry =
+                    find_entry_in_inode(NUM(EXT2_ROOT_INO_IDX), CURRENT_DIR);
+    
+    while (token != NULL) {
+        
+        // One or more entries in the path is not a directory
+        if (curr_dir_entry->file_type != EXT2_FT_DIR) {
+            exit(ENOENT);
+        }
+        
+        curr_dir_entry = find_entry_in_inode(curr_dir_entry->inode, token);
+        
+        // One or more entries in the path don't exist
+        if (curr_dir_entry == NULL) {
+            exit(ENOENT);
+        }
+        
+        token = strtok(NULL, DIR_DELIMITER);
+    }
+    
+    return curr_dir_entry;
+}
+
+
+/*
+ * Changes the size of the file with the given `path` to `size` bytes.
+ *
+ * Returns EXIT_SUCCESS, if the file was resized.
+ *               ENOENT, if the file does not exist.
+ *               EISDIR, if the given `path` refers to a directory.
+ *                EFBIG, if `size` is larger than the maximum file size.
+ */
+int truncate_file(char *path, unsigned int size) {
+    
+    struct ext2_dir_entry *entry = find_file_entry(path);
+    
+    // Only regular files can be truncated
+    if (entry->file_type == EXT2_FT_DIR) {
+        return EISDIR;
+    }
+    else if (entry->file_type != EXT2_FT_REG_FILE) {
+        return ENOENT;
+    }
+    
+    struct ext2_inode *inode = get_inode_table() + INDEX(entry->inode);
+    
+    return truncate_inode(inode, size);
+}
+
+
+int main(int argc, char *argv[]) {
+    
+    if (argc < MIN_ARGUMENT_V || argc > MAX_ARGUMENT_V) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    int discard = FALSE;
+    char *disk_image_path = argv[1];
+    char *file_path;
+    char *size_arg;
+    
+    // Check if flag for discarding freed blocks is present
+    if (argc == MAX_ARGUMENT_V) {
+        if (strcmp(argv[2], DISCARD_FLAG) != 0) {
+            fprintf(stderr, USAGE, argv[0]);
+            return EXIT_FAILURE;
+        }
+        discard = TRUE;
+        file_path = argv[3];
+        size_arg = argv[4];
+    }
+    else {
+        file_path = argv[2];
+        size_arg = argv[3];
+    }
+    
+    char *end;
+    unsigned long size = strtoul(size_arg, &end, 10);
+    
+    if (*size_arg == '\0' || *end != '\0' || size > (unsigned int) -1) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    disk = read_disk_image(disk_image_path);
+    
+    if (discard) {
+        enable_discard();
+    }
+    
+    // Free all released blocks from the bitmap at once
+    begin_block_free_batch();
+    
+    int result = truncate_file(file_path, (unsigned int) size);
+    
+    end_block_free_batch();
+    
+    return result;
+    
+}
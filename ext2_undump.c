@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ext2_utils.h"
+
+
+#define USAGE "Usage: %s <image file name> [<dump file name>]\n"\
+              "The dump is read from standard input if no file is given, "\
+              "e.g. to be decompressed:\n"\
+              "    zstd -dc disk.dump.zst | %s disk.img\n"
+
+#define MIN_ARGUMENT_V 2
+#define MAX_ARGUMENT_V 3
+
+// The image is restored next to its final path, under this suffix
+#define TMP_SUFFIX ".tmp"
+
+unsigned char *disk = NULL;
+
+
+int main(int argc, char *argv[]) {
+    
+    if (argc < MIN_ARGUMENT_V || argc > MAX_ARGUMENT_V) {
+        fprintf(stderr, USAGE, argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    char *disk_image_path = argv[1];
+    int dump_fd = STDIN_FILENO;
+    
+    if (argc == MAX_ARGUMENT_V) {
+        dump_fd = open(argv[2], O_RDONLY);
+        
+        if (dump_fd < 0) {
+            perror("open - Could not open dump file");
+            return errno;
+        }
+    }
+    
+    // Any image already at the path is only replaced once the whole dump
+    // has been restored
+    char *tmp_path = malloc(strlen(disk_image_path) + strlen(TMP_SUFFIX) + 1);
+    
+    if (tmp_path == NULL) {
+        exit(ENOMEM);
+    }
+    
+    strcpy(tmp_path, disk_image_path);
+    strcat(tmp_path, TMP_SUFFIX);
+    
+    int image_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    if (image_fd < 0) {
+        perror("open - Could not create disk image");
+        return errno;
+    }
+    
+    // The image is created sparse, so the blocks that were left out of the
+    // dump are holes
+    unsigned int num_written;
+    int result = read_block_runs(dump_fd, image_fd, DUMP_MAGIC, NULL,
+                                 &num_written);
+    
+    if (result != EXIT_SUCCESS) {
+        fprintf(stderr, "Could not restore from dump: %s\n",
+                strerror(result));
+        unlink(tmp_path);
+        return result;
+    }
+    
+    if (close(image_fd) != 0) {
+        perror("close - Could not write disk image");
+        result = errno;
+        unlink(tmp_path);
+        return result;
+    }
+    
+    if (rename(tmp_path, disk_image_path) != 0) {
+        perror("rename - Could not replace disk image");
+        result = errno;
+        unlink(tmp_path);
+        return result;
+    }
+    
+    free(tmp_path);
+    
+    // Any logs kept for an earlier image at this path no longer apply
+    disk = read_disk_image(disk_image_path);
+    clear_dirty_log();
+    clear_tombstone_log();
+    
+    fprintf(stderr, "%u blocks restored\n", num_written);
+    
+    return EXIT_SUCCESS;
+    
+}
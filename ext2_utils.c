@@ -1,32 +1,140 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
+#include <stddef.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "ext2_utils.h"
 
 extern unsigned char *disk;
 
+// File descriptor of the open disk image, and the size of its mapping
+static int disk_fd = -1;
+static size_t disk_size = 0;
+
+// Whether freed blocks are punched out of the image file
+static int discard_freed_blocks = FALSE;
+
+// Kernel used by count_set_bits(), chosen on first use
+static int popcount_kernel = -1;
+
+// Blocks whose freeing has been deferred by begin_block_free_batch()
+static unsigned int *pending_frees = NULL;
+static int num_pending_frees = 0;
+static int max_pending_frees = 0;
+
+// Inodes modified since the image was opened, one byte per inode, and the
+// sidecar log they are appended to on exit
+static unsigned char *dirty_inodes = NULL;
+static char *dirty_log_path = NULL;
+
+// Ring of tombstones for the files deleted from the image
+static char *tombstone_log_path = NULL;
+
+static void write_dirty_log();
+
 /*
- * Opens the virtual disk image at the given path
+ * Returns the path of the sidecar file with the given suffix, kept next to
+ * the disk image at `image_path`.
  */
-unsigned char *read_disk_image(char *path) {
+static char *get_sidecar_path(char *image_path, char *suffix) {
+    
+    char *sidecar_path = malloc(strlen(image_path) + strlen(suffix) + 1);
+    
+    if (sidecar_path == NULL) {
+        exit(ENOMEM);
+    }
+    
+    strcpy(sidecar_path, image_path);
+    strcat(sidecar_path, suffix);
     
-    int fd = open(path, O_RDWR);
+    return sidecar_path;
+}
+
+/*
+ * Maps the virtual disk image at the given path, for reading and writing
+ * or for reading only. The whole image file is mapped, so images of any
+ * size (see ext2_mkfs) can be opened.
+ */
+static unsigned char *map_disk_image(char *path, int writable) {
+    
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    
+    // Fall back to the assignment's image size if the file can't be sized
+    struct stat st;
+    size_t image_size = NUM_BLOCKS * EXT2_BLOCK_SIZE;
+    
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        image_size = st.st_size;
+    }
 
-    unsigned char *disk = mmap(NULL, NUM_BLOCKS * EXT2_BLOCK_SIZE,
-                               PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    unsigned char *disk = mmap(NULL, image_size,
+                               writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                               MAP_SHARED, fd, 0);
+    
+    disk_fd = fd;
+    disk_size = image_size;
     
     if (disk == MAP_FAILED) {
         perror("mmap - Could not open disk image");
         exit(EXIT_FAILURE);
     }
     
+    // Record the inodes this tool modifies, for incremental checking, and
+    // the files it deletes, for restoring them
+    if (writable) {
+        dirty_log_path = get_sidecar_path(path, DIRTY_LOG_SUFFIX);
+        tombstone_log_path = get_sidecar_path(path, TOMBSTONE_LOG_SUFFIX);
+        
+        atexit(write_dirty_log);
+    }
+    
     return disk;
 }
 
+/*
+ * Opens the virtual disk image at the given path
+ */
+unsigned char *read_disk_image(char *path) {
+    return map_disk_image(path, TRUE);
+}
+
+/*
+ * Opens the virtual disk image at the given path for reading only. Any
+ * write to the image faults.
+ */
+unsigned char *read_disk_image_readonly(char *path) {
+    return map_disk_image(path, FALSE);
+}
+
+/*
+ * Unmaps and closes the disk image that is open, e.g. before opening it
+ * again with a different size or access.
+ */
+void close_disk_image() {
+    
+    if (disk == NULL) {
+        return;
+    }
+    
+    munmap(disk, disk_size);
+    close(disk_fd);
+    
+    disk = NULL;
+    disk_fd = -1;
+}
+
 struct ext2_super_block *get_super_block() {
     return (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
 }
@@ -65,6 +173,36 @@ int get_inodes_count() {
     return sb->s_inodes_count;
 }
 
+/*
+ * Returns the number of inodes at the start of the inode table that have
+ * ever been written. Unless the group is flagged as zeroed, the rest of the
+ * table was left unwritten by ext2_mkfs (it reads as zeroes), and does not
+ * need to be scanned.
+ */
+unsigned int get_initialized_inodes_count() {
+    struct ext2_group_desc *gd = get_group_descriptor();
+    unsigned int inodes_count = get_inodes_count();
+    
+    if ((gd->bg_pad & EXT2_BG_INODE_ZEROED) ||
+        BG_INODES_UNWRITTEN(gd) > inodes_count) {
+        return inodes_count;
+    }
+    
+    return inodes_count - BG_INODES_UNWRITTEN(gd);
+}
+
+/*
+ * Moves the end of the initialized part of the inode table (see
+ * get_initialized_inodes_count) past the given inode, if it is not already.
+ */
+void initialize_inode(unsigned int inode_num) {
+    struct ext2_group_desc *gd = get_group_descriptor();
+    
+    if (inode_num > get_initialized_inodes_count()) {
+        BG_INODES_UNWRITTEN(gd) = get_inodes_count() - inode_num;
+    }
+}
+
 
 unsigned int get_timestamp() {
     unsigned int current_time = (unsigned int) time(NULL);
@@ -76,6 +214,592 @@ unsigned int get_timestamp() {
     return current_time;
 }
 
+/*
+ * Records that the inode with the given number, or the blocks it points to,
+ * has been modified. The inode is appended to the dirty log on exit.
+ */
+void mark_inode_dirty(unsigned int inode_num) {
+    
+    if (dirty_log_path == NULL || inode_num == UNDEFINED ||
+        inode_num > get_inodes_count()) {
+        return;
+    }
+    
+    if (dirty_inodes == NULL) {
+        dirty_inodes = calloc(get_inodes_count(), sizeof(unsigned char));
+        
+        if (dirty_inodes == NULL) {
+            exit(ENOMEM);
+        }
+    }
+    
+    dirty_inodes[INDEX(inode_num)] = TRUE;
+}
+
+/*
+ * Same as mark_inode_dirty, for an inode given by its place in the table.
+ */
+static void mark_inode_struct_dirty(struct ext2_inode *inode) {
+    mark_inode_dirty(NUM(inode - get_inode_table()));
+}
+
+/*
+ * Appends the inodes marked dirty to the dirty log of the image, one inode
+ * number per line.
+ */
+static void write_dirty_log() {
+    
+    if (dirty_log_path == NULL || dirty_inodes == NULL) {
+        return;
+    }
+    
+    FILE *log = fopen(dirty_log_path, "a");
+    
+    if (log == NULL) {
+        perror("fopen - Could not open dirty log");
+        return;
+    }
+    
+    int i;
+    for (i = 0; i < get_inodes_count(); i++) {
+        if (dirty_inodes[i]) {
+            fprintf(log, "%d\n", NUM(i));
+        }
+    }
+    
+    fclose(log);
+}
+
+/*
+ * Reads the dirty log of the image at the given path into `dirty`, which
+ * holds one byte per inode. Entries out of range are ignored.
+ *
+ * Returns the number of distinct dirty inodes, or 0 if there is no log.
+ */
+int read_dirty_log(char *image_path, unsigned char *dirty) {
+    
+    char *log_path = get_sidecar_path(image_path, DIRTY_LOG_SUFFIX);
+    FILE *log = fopen(log_path, "r");
+    free(log_path);
+    
+    if (log == NULL) {
+        return 0;
+    }
+    
+    int num_dirty = 0;
+    int inode_num;
+    
+    while (fscanf(log, "%d", &inode_num) == 1) {
+        if (inode_num > 0 && inode_num <= get_inodes_count() &&
+            !dirty[INDEX(inode_num)]) {
+            
+            dirty[INDEX(inode_num)] = TRUE;
+            num_dirty++;
+        }
+    }
+    
+    fclose(log);
+    
+    return num_dirty;
+}
+
+/*
+ * Deletes the dirty log of the image, and stops recording modified inodes,
+ * once the whole image is known to be consistent.
+ */
+void clear_dirty_log() {
+    
+    if (dirty_log_path == NULL) {
+        return;
+    }
+    
+    if (unlink(dirty_log_path) != 0 && errno != ENOENT) {
+        perror("unlink - Could not delete dirty log");
+    }
+    
+    free(dirty_log_path);
+    dirty_log_path = NULL;
+}
+
+/*
+ * Opens the tombstone log of the image, and reads its header. A missing or
+ * unrecognized log is started afresh.
+ *
+ * Returns the file descriptor of the log, or -1 if it can not be opened.
+ */
+static int open_tombstone_log(struct tombstone_log_header *header) {
+    
+    if (tombstone_log_path == NULL) {
+        return -1;
+    }
+    
+    int fd = open(tombstone_log_path, O_RDWR | O_CREAT, 0644);
+    
+    if (fd < 0) {
+        return -1;
+    }
+    
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+        header->magic != TOMBSTONE_LOG_MAGIC ||
+        header->capacity != TOMBSTONE_LOG_CAPACITY) {
+        
+        header->magic = TOMBSTONE_LOG_MAGIC;
+        header->capacity = TOMBSTONE_LOG_CAPACITY;
+        header->next = 0;
+        header->count = 0;
+    }
+    
+    return fd;
+}
+
+/*
+ * Returns the offset of the given slot within the tombstone log.
+ */
+static off_t get_tombstone_offset(unsigned int slot) {
+    return sizeof(struct tombstone_log_header) +
+           (off_t) slot * sizeof(struct tombstone);
+}
+
+/*
+ * Appends a tombstone for the entry `name` (of `file_type`) in the
+ * directory with inode `dir_inode_num`, which referred to `inode_num`, to
+ * the tombstone log of the image. The block map of the inode is kept, so
+ * that a restore can tell whether the inode has been reused since. Once
+ * the log is full, the oldest tombstone is overwritten.
+ */
+void record_tombstone(unsigned int dir_inode_num, unsigned int inode_num,
+                      char *name, int name_len, unsigned char file_type) {
+    
+    struct tombstone_log_header header;
+    int fd = open_tombstone_log(&header);
+    
+    if (fd < 0) {
+        return;
+    }
+    
+    struct tombstone tomb;
+    memset(&tomb, 0, sizeof(tomb));
+    
+    tomb.dir_inode_num = dir_inode_num;
+    tomb.inode_num = inode_num;
+    tomb.dtime = get_timestamp();
+    tomb.file_type = file_type;
+    tomb.name_len = name_len;
+    memcpy(tomb.name, name, name_len);
+    memcpy(tomb.blocks, (get_inode_table() + INDEX(inode_num))->i_block,
+           sizeof(tomb.blocks));
+    
+    unsigned int slot = header.next;
+    header.next = (header.next + 1) % header.capacity;
+    if (header.count < header.capacity) {
+        header.count++;
+    }
+    
+    if (pwrite(fd, &tomb, sizeof(tomb), get_tombstone_offset(slot)) !=
+                                                        sizeof(tomb) ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        perror("pwrite - Could not write tombstone");
+    }
+    
+    close(fd);
+}
+
+/*
+ * Finds the most recent tombstone for the entry `name` in the directory
+ * with inode `dir_inode_num`, and copies it into `tomb`.
+ *
+ * Returns the slot of the tombstone in the log, or -1 if there is none.
+ */
+int find_tombstone(unsigned int dir_inode_num, char *name,
+                   struct tombstone *tomb) {
+    
+    struct tombstone_log_header header;
+    int fd = open_tombstone_log(&header);
+    
+    if (fd < 0) {
+        return -1;
+    }
+    
+    // The whole ring is read at once
+    size_t ring_size = header.count * sizeof(struct tombstone);
+    struct tombstone *ring = malloc(ring_size + 1);
+    
+    if (ring == NULL) {
+        exit(ENOMEM);
+    }
+    
+    int found = -1;
+    int name_len = get_name_len(name);
+    
+    if (pread(fd, ring, ring_size, get_tombstone_offset(0)) ==
+                                                    (ssize_t) ring_size) {
+        
+        // Newest first, walking back from the slot written last
+        unsigned int i;
+        for (i = 1; i <= header.count && found < 0; i++) {
+            unsigned int slot = (header.next + header.capacity - i) %
+                                                        header.capacity;
+            struct tombstone *t = &ring[slot];
+            
+            if (t->inode_num != UNDEFINED &&
+                t->dir_inode_num == dir_inode_num &&
+                t->name_len == name_len &&
+                strncmp(t->name, name, name_len) == 0) {
+                
+                *tomb = *t;
+                found = slot;
+            }
+        }
+    }
+    
+    free(ring);
+    close(fd);
+    
+    return found;
+}
+
+/*
+ * Marks the tombstone in the given slot of the log as used up, once the
+ * file it describes has been restored.
+ */
+void clear_tombstone(int slot) {
+    
+    struct tombstone_log_header header;
+    int fd = open_tombstone_log(&header);
+    
+    if (fd < 0) {
+        return;
+    }
+    
+    unsigned int inode_num = UNDEFINED;
+    
+    if (pwrite(fd, &inode_num, sizeof(inode_num), get_tombstone_offset(slot) +
+               offsetof(struct tombstone, inode_num)) != sizeof(inode_num)) {
+        perror("pwrite - Could not clear tombstone");
+    }
+    
+    close(fd);
+}
+
+/*
+ * Deletes the tombstone log of the image, e.g. once the file system it
+ * describes has been replaced.
+ */
+void clear_tombstone_log() {
+    
+    if (tombstone_log_path == NULL) {
+        return;
+    }
+    
+    if (unlink(tombstone_log_path) != 0 && errno != ENOENT) {
+        perror("unlink - Could not delete tombstone log");
+    }
+}
+
+/*
+ * Reads exactly `len` bytes from the given file (or pipe) into `buf`.
+ *
+ * Returns EXIT_SUCCESS, if all of the bytes were read.
+ *               EIO, if the end of the file was reached first.
+ * Otherwise, returns the error from read().
+ */
+int read_fully(int fd, void *buf, size_t len) {
+    
+    unsigned char *pos = buf;
+    
+    while (len > 0) {
+        ssize_t num_read = read(fd, pos, len);
+        
+        if (num_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_read < 0) {
+            return errno;
+        }
+        if (num_read == 0) {
+            return EIO;
+        }
+        
+        pos += num_read;
+        len -= num_read;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Writes all `len` bytes of `buf` to the given file (or pipe).
+ *
+ * Returns EXIT_SUCCESS, or the error from write().
+ */
+int write_fully(int fd, void *buf, size_t len) {
+    
+    unsigned char *pos = buf;
+    
+    while (len > 0) {
+        ssize_t num_written = write(fd, pos, len);
+        
+        if (num_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_written < 0) {
+            return errno;
+        }
+        
+        pos += num_written;
+        len -= num_written;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+// Largest run of blocks copied from a stream at once
+#define MAX_STREAM_COPY_BLOCKS 256
+
+/*
+ * Writes a stream of blocks of the disk image with the given magic number
+ * (a dump or a patch) to the given file: the header, the runs, and then
+ * the contents of the blocks of every run. A patch records the identity of
+ * the image it is made against in `base` (NULL for a dump).
+ *
+ * Returns EXIT_SUCCESS, or the error from write().
+ */
+int write_block_runs(int fd, unsigned int magic, struct content_hash *base,
+                     struct dump_run *runs, unsigned int num_runs) {
+    
+    struct dump_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = magic;
+    header.version = DUMP_VERSION;
+    header.block_size = EXT2_BLOCK_SIZE;
+    header.blocks_count = get_blocks_count();
+    header.num_runs = num_runs;
+    
+    if (base != NULL) {
+        header.base = *base;
+    }
+    
+    int result = write_fully(fd, &header, sizeof(header));
+    
+    if (result == EXIT_SUCCESS) {
+        result = write_fully(fd, runs, num_runs * sizeof(struct dump_run));
+    }
+    
+    unsigned int i;
+    for (i = 0; i < num_runs && result == EXIT_SUCCESS; i++) {
+        result = write_fully(fd, BLOCK_START(disk, runs[i].first_block_num),
+                             runs[i].count * EXT2_BLOCK_SIZE);
+    }
+    
+    return result;
+}
+
+/*
+ * Copies the blocks of the given runs that are (if `identity` is set) or
+ * are not among the first IMAGE_IDENTITY_BLOCKS blocks from the staging
+ * file `stage_fd`, which holds the contents of every run in order, to their
+ * place in the disk image file `image_fd`.
+ *
+ * Returns EXIT_SUCCESS, or the error from read() or write().
+ */
+static int write_staged_blocks(int stage_fd, int image_fd,
+                               struct dump_run *runs, unsigned int num_runs,
+                               int identity, unsigned char *buf) {
+    
+    off_t run_offset = 0;
+    
+    unsigned int i;
+    for (i = 0; i < num_runs; i++) {
+        unsigned int first = runs[i].first_block_num;
+        unsigned int end = first + runs[i].count;
+        
+        // The part of the run of the requested kind
+        unsigned int block_num = first;
+        unsigned int end_block_num = end;
+        
+        if (identity && end_block_num > IMAGE_IDENTITY_BLOCKS) {
+            end_block_num = (first < IMAGE_IDENTITY_BLOCKS) ?
+                            IMAGE_IDENTITY_BLOCKS : first;
+        }
+        if (!identity && block_num < IMAGE_IDENTITY_BLOCKS) {
+            block_num = (end > IMAGE_IDENTITY_BLOCKS) ?
+                        IMAGE_IDENTITY_BLOCKS : end;
+        }
+        
+        // Copy the part through the buffer, a piece at a time
+        while (block_num < end_block_num) {
+            unsigned int count = end_block_num - block_num;
+            
+            if (count > MAX_STREAM_COPY_BLOCKS) {
+                count = MAX_STREAM_COPY_BLOCKS;
+            }
+            
+            size_t len = count * EXT2_BLOCK_SIZE;
+            off_t stage_offset = run_offset +
+                                 (off_t) (block_num - first) * EXT2_BLOCK_SIZE;
+            
+            ssize_t num_read = pread(stage_fd, buf, len, stage_offset);
+            
+            if (num_read < 0) {
+                return errno;
+            }
+            if (num_read != len) {
+                return EIO;
+            }
+            if (pwrite(image_fd, buf, len,
+                       (off_t) block_num * EXT2_BLOCK_SIZE) != len) {
+                return errno;
+            }
+            
+            block_num += count;
+        }
+        
+        run_offset += (off_t) runs[i].count * EXT2_BLOCK_SIZE;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Reads a stream of blocks with the given magic number from `fd`, and
+ * writes every block to its place in the disk image file `image_fd`. The
+ * image file is resized to the number of blocks in the stream first (any
+ * new space is a hole). The number of blocks written is returned through
+ * `num_blocks`. If `base` is not NULL, the stream must have been made
+ * against an image with that identity (see hash_image_identity), or the
+ * image is left untouched.
+ *
+ * The whole stream is staged in a temporary file and checked before the
+ * image is written to, so that a stream that is cut short leaves the image
+ * as it was. The identity blocks are written last, so that if writing the
+ * image fails part way, the image still matches its base and the stream
+ * can be applied again.
+ *
+ * Returns EXIT_SUCCESS, if the whole stream was applied.
+ *               EINVAL, if the stream is of another kind, or corrupt.
+ *               ESTALE, if the stream was made against another image.
+ *               EIO, if the stream ends early.
+ * Otherwise, returns the error from read() or write().
+ */
+int read_block_runs(int fd, int image_fd, unsigned int magic,
+                    struct content_hash *base, unsigned int *num_blocks) {
+    
+    struct dump_header header;
+    int result = read_fully(fd, &header, sizeof(header));
+    
+    *num_blocks = 0;
+    
+    if (result != EXIT_SUCCESS) {
+        return result;
+    }
+    
+    if (header.magic != magic || header.version != DUMP_VERSION ||
+        header.block_size != EXT2_BLOCK_SIZE) {
+        return EINVAL;
+    }
+    
+    if (base != NULL && compare_content_hash(&header.base, base) != 0) {
+        return ESTALE;
+    }
+    
+    struct dump_run *runs = malloc(header.num_runs * sizeof(struct dump_run));
+    unsigned char *buf = malloc(MAX_STREAM_COPY_BLOCKS * EXT2_BLOCK_SIZE);
+    
+    if ((runs == NULL && header.num_runs > 0) || buf == NULL) {
+        exit(ENOMEM);
+    }
+    
+    result = read_fully(fd, runs, header.num_runs * sizeof(struct dump_run));
+    
+    // The runs must be in order, and not overlap
+    unsigned int total_blocks = 0;
+    unsigned int prev_end_block_num = 0;
+    
+    unsigned int i;
+    for (i = 0; i < header.num_runs && result == EXIT_SUCCESS; i++) {
+        unsigned int end_block_num = runs[i].first_block_num + runs[i].count;
+        
+        if (end_block_num > header.blocks_count ||
+            end_block_num < runs[i].first_block_num ||
+            runs[i].first_block_num < prev_end_block_num) {
+            result = EINVAL;
+        }
+        total_blocks += runs[i].count;
+        prev_end_block_num = end_block_num;
+    }
+    
+    // Unlinked as soon as it is created, so it never outlives the tool
+    FILE *stage = NULL;
+    
+    if (result == EXIT_SUCCESS) {
+        stage = tmpfile();
+        
+        if (stage == NULL) {
+            result = errno;
+        }
+    }
+    
+    // Stage the contents of every run, a piece at a time
+    unsigned int num_staged = 0;
+    
+    while (result == EXIT_SUCCESS && num_staged < total_blocks) {
+        unsigned int count = total_blocks - num_staged;
+        
+        if (count > MAX_STREAM_COPY_BLOCKS) {
+            count = MAX_STREAM_COPY_BLOCKS;
+        }
+        
+        result = read_fully(fd, buf, count * EXT2_BLOCK_SIZE);
+        
+        if (result == EXIT_SUCCESS) {
+            result = write_fully(fileno(stage), buf, count * EXT2_BLOCK_SIZE);
+        }
+        
+        num_staged += count;
+    }
+    
+    // Only now that the whole stream is in hand is the image touched
+    if (result == EXIT_SUCCESS &&
+        ftruncate(image_fd, (off_t) header.blocks_count *
+                            EXT2_BLOCK_SIZE) != 0) {
+        result = errno;
+    }
+    
+    if (result == EXIT_SUCCESS) {
+        result = write_staged_blocks(fileno(stage), image_fd, runs,
+                                     header.num_runs, FALSE, buf);
+    }
+    
+    if (result == EXIT_SUCCESS) {
+        result = write_staged_blocks(fileno(stage), image_fd, runs,
+                                     header.num_runs, TRUE, buf);
+    }
+    
+    if (result == EXIT_SUCCESS) {
+        *num_blocks = total_blocks;
+    }
+    
+    if (stage != NULL) {
+        fclose(stage);
+    }
+    
+    free(runs);
+    free(buf);
+    
+    return result;
+}
+
+/*
+ * Returns the time elapsed since some fixed point, in seconds, for timing.
+ */
+double get_seconds() {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
 
 /*
  * Sets the first low bit in the bitmap to high, and returns
@@ -132,37 +856,483 @@ int is_inode_in_use(unsigned int inode_num) {
 int is_block_in_use(unsigned int block_num) {
     unsigned char *block_bitmap = get_block_bitmap();
     
-    return is_resource_in_use(block_bitmap, block_num);
+    return is_resource_in_use(block_bitmap, block_num);
+}
+
+
+/*
+ * Sets the corresponding bit for the given resource_num to high.
+ */
+void set_resource_in_use(unsigned char *bitmap, int resource_num) {
+    int index = INDEX(resource_num);
+    
+    int byte_index = index / CHAR_BIT;
+    int bit_offset = index % CHAR_BIT;
+    
+    // Set the appropriate bit in bitmap to 1
+    bitmap[byte_index] |= 1 << bit_offset; 
+}
+
+
+/*
+ * Sets the corresponding bit for the given resource_num to low.
+ */
+void free_resource(unsigned char *bitmap, int resource_num) {
+    int index = INDEX(resource_num);
+    
+    int byte_index = index / CHAR_BIT;
+    int bit_offset = index % CHAR_BIT;
+    
+    // Set the appropriate bit in bitmap to 0
+    bitmap[byte_index] &= (~(1 << bit_offset));
+}
+
+/*
+ * Sets the bits for `count` consecutive resources, starting at resource_num,
+ * to low. Whole bytes are cleared at once; only the partial bytes at either
+ * end of the range are masked.
+ *
+ * Returns the number of bits that were high before being cleared.
+ */
+int free_resource_range(unsigned char *bitmap, int resource_num, int count) {
+    int index = INDEX(resource_num);
+    int end = index + count;
+    int num_freed = 0;
+    
+    // Leading partial byte
+    while (index < end && index % CHAR_BIT != 0) {
+        int byte_index = index / CHAR_BIT;
+        int bit_offset = index % CHAR_BIT;
+        
+        if (IS_IN_USE(bitmap[byte_index], bit_offset)) {
+            bitmap[byte_index] &= (~(1 << bit_offset));
+            num_freed++;
+        }
+        index++;
+    }
+    
+    // Whole bytes
+    while (index + CHAR_BIT <= end) {
+        int byte_index = index / CHAR_BIT;
+        
+        num_freed += __builtin_popcount(bitmap[byte_index]);
+        bitmap[byte_index] = 0;
+        index += CHAR_BIT;
+    }
+    
+    // Trailing partial byte
+    if (index < end) {
+        int byte_index = index / CHAR_BIT;
+        unsigned char mask = (1 << (end - index)) - 1;
+        
+        num_freed += __builtin_popcount(bitmap[byte_index] & mask);
+        bitmap[byte_index] &= (~mask);
+    }
+    
+    return num_freed;
+}
+
+/*
+ * Counts the high bits in `num_bytes` bytes, 64 bits at a time.
+ */
+unsigned long long popcount_scalar(unsigned char *bytes, size_t num_bytes) {
+    unsigned long long count = 0;
+    size_t i = 0;
+    
+    for (; i + sizeof(unsigned long long) <= num_bytes;
+         i += sizeof(unsigned long long)) {
+        unsigned long long word;
+        
+        memcpy(&word, bytes + i, sizeof(word));
+        count += __builtin_popcountll(word);
+    }
+    
+    for (; i < num_bytes; i++) {
+        count += __builtin_popcount(bytes[i]);
+    }
+    
+    return count;
+}
+
+#if defined(__x86_64__)
+
+/*
+ * Counts the high bits in each byte of `v` with a nibble lookup table, and
+ * sums them into four 64-bit lanes.
+ */
+__attribute__((target("avx2")))
+static __m256i popcount_avx2_vector(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                     _mm256_shuffle_epi8(lookup, hi));
+    
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+// Carry-save adder: (h, l) = a + b + c, bit by bit
+#define CSA(H, L, A, B, C) do {                                         \
+    __m256i u = _mm256_xor_si256(A, B);                                 \
+    H = _mm256_or_si256(_mm256_and_si256(A, B), _mm256_and_si256(u, C)); \
+    L = _mm256_xor_si256(u, C);                                         \
+} while (0)
+
+#define LOAD_256(P) _mm256_loadu_si256((__m256i *) (P))
+
+/*
+ * Counts the high bits in `num_bytes` bytes with the Harley-Seal method:
+ * 16 vectors at a time are reduced by a tree of carry-save adders, so that
+ * only one vector in 16 needs a full population count.
+ */
+__attribute__((target("avx2")))
+unsigned long long popcount_avx2(unsigned char *bytes, size_t num_bytes) {
+    const size_t vec_size = sizeof(__m256i);
+    
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = _mm256_setzero_si256();
+    __m256i twos = _mm256_setzero_si256();
+    __m256i fours = _mm256_setzero_si256();
+    __m256i eights = _mm256_setzero_si256();
+    __m256i sixteens, twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+    size_t i = 0;
+    
+    for (; i + 16 * vec_size <= num_bytes; i += 16 * vec_size) {
+        unsigned char *p = bytes + i;
+        
+        CSA(twos_a, ones, ones, LOAD_256(p), LOAD_256(p + vec_size));
+        CSA(twos_b, ones, ones, LOAD_256(p + 2 * vec_size),
+            LOAD_256(p + 3 * vec_size));
+        CSA(fours_a, twos, twos, twos_a, twos_b);
+        CSA(twos_a, ones, ones, LOAD_256(p + 4 * vec_size),
+            LOAD_256(p + 5 * vec_size));
+        CSA(twos_b, ones, ones, LOAD_256(p + 6 * vec_size),
+            LOAD_256(p + 7 * vec_size));
+        CSA(fours_b, twos, twos, twos_a, twos_b);
+        CSA(eights_a, fours, fours, fours_a, fours_b);
+        CSA(twos_a, ones, ones, LOAD_256(p + 8 * vec_size),
+            LOAD_256(p + 9 * vec_size));
+        CSA(twos_b, ones, ones, LOAD_256(p + 10 * vec_size),
+            LOAD_256(p + 11 * vec_size));
+        CSA(fours_a, twos, twos, twos_a, twos_b);
+        CSA(twos_a, ones, ones, LOAD_256(p + 12 * vec_size),
+            LOAD_256(p + 13 * vec_size));
+        CSA(twos_b, ones, ones, LOAD_256(p + 14 * vec_size),
+            LOAD_256(p + 15 * vec_size));
+        CSA(fours_b, twos, twos, twos_a, twos_b);
+        CSA(eights_b, fours, fours, fours_a, fours_b);
+        CSA(sixteens, eights, eights, eights_a, eights_b);
+        
+        total = _mm256_add_epi64(total, popcount_avx2_vector(sixteens));
+    }
+    
+    // Weigh the partial sums left in the adders
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total,
+                _mm256_slli_epi64(popcount_avx2_vector(eights), 3));
+    total = _mm256_add_epi64(total,
+                _mm256_slli_epi64(popcount_avx2_vector(fours), 2));
+    total = _mm256_add_epi64(total,
+                _mm256_slli_epi64(popcount_avx2_vector(twos), 1));
+    total = _mm256_add_epi64(total, popcount_avx2_vector(ones));
+    
+    for (; i + vec_size <= num_bytes; i += vec_size) {
+        total = _mm256_add_epi64(total,
+                                 popcount_avx2_vector(LOAD_256(bytes + i)));
+    }
+    
+    unsigned long long lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, total);
+    
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           popcount_scalar(bytes + i, num_bytes - i);
+}
+
+#undef CSA
+#undef LOAD_256
+
+/*
+ * Counts the high bits in `num_bytes` bytes with the AVX-512 VPOPCNTQ
+ * instruction, 512 bits at a time.
+ */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+unsigned long long popcount_avx512(unsigned char *bytes, size_t num_bytes) {
+    const size_t vec_size = sizeof(__m512i);
+    
+    __m512i total = _mm512_setzero_si512();
+    size_t i = 0;
+    
+    for (; i + vec_size <= num_bytes; i += vec_size) {
+        __m512i v = _mm512_loadu_si512((void *) (bytes + i));
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(v));
+    }
+    
+    return _mm512_reduce_add_epi64(total) +
+           popcount_scalar(bytes + i, num_bytes - i);
+}
+
+#endif
+
+/*
+ * Selects the kernel used by count_set_bits(): one of the POPCOUNT_*
+ * values, or POPCOUNT_BEST for the fastest one the CPU supports. Kernels
+ * the CPU does not support fall back to POPCOUNT_SCALAR.
+ *
+ * Returns the kernel selected.
+ */
+int select_popcount_kernel(int kernel) {
+    
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    
+    int has_avx512 = __builtin_cpu_supports("avx512f") &&
+                     __builtin_cpu_supports("avx512vpopcntdq");
+    int has_avx2 = __builtin_cpu_supports("avx2");
+#else
+    int has_avx512 = FALSE;
+    int has_avx2 = FALSE;
+#endif
+    
+    if (kernel == POPCOUNT_BEST) {
+        kernel = has_avx512 ? POPCOUNT_AVX512 :
+                 has_avx2 ? POPCOUNT_AVX2 : POPCOUNT_SCALAR;
+    }
+    
+    if ((kernel == POPCOUNT_AVX512 && !has_avx512) ||
+        (kernel == POPCOUNT_AVX2 && !has_avx2)) {
+        kernel = POPCOUNT_SCALAR;
+    }
+    
+    popcount_kernel = kernel;
+    
+    return kernel;
+}
+
+/*
+ * Counts the high bits among the first `num_bits` bits of the given bitmap.
+ * Bits past num_bits (the padding in the last byte) are ignored.
+ */
+unsigned int count_set_bits(unsigned char *bitmap, unsigned int num_bits) {
+    
+    if (popcount_kernel < 0) {
+        select_popcount_kernel(POPCOUNT_BEST);
+    }
+    
+    size_t num_bytes = num_bits / CHAR_BIT;
+    unsigned long long count;
+    
+    switch (popcount_kernel) {
+#if defined(__x86_64__)
+        case POPCOUNT_AVX512:
+            count = popcount_avx512(bitmap, num_bytes);
+            break;
+        case POPCOUNT_AVX2:
+            count = popcount_avx2(bitmap, num_bytes);
+            break;
+#endif
+        default:
+            count = popcount_scalar(bitmap, num_bytes);
+            break;
+    }
+    
+    // Trailing partial byte
+    if (num_bits % CHAR_BIT != 0) {
+        unsigned char mask = (1 << (num_bits % CHAR_BIT)) - 1;
+        count += __builtin_popcount(bitmap[num_bytes] & mask);
+    }
+    
+    return count;
+}
+
+/*
+ * Appends to `inode_nums` the inodes, among those with indexes in
+ * [first, end), that are free in the inode bitmap but have a deletion time.
+ *
+ * Returns the new number of inodes in `inode_nums`.
+ */
+static int collect_deleted_inodes_scalar(unsigned int first, unsigned int end,
+                                         unsigned int *inode_nums, int count) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned char *inode_bitmap = get_inode_bitmap();
+    
+    unsigned int i;
+    for (i = first; i < end; i++) {
+        if (i_table[i].i_dtime != 0 &&
+            !IS_IN_USE(inode_bitmap[i / CHAR_BIT], i % CHAR_BIT)) {
+            inode_nums[count++] = NUM(i);
+        }
+    }
+    
+    return count;
+}
+
+#if defined(__x86_64__)
+
+/*
+ * Same as collect_deleted_inodes_scalar, for the first `end` inodes (a
+ * multiple of 8). The deletion times of 8 inodes are gathered at a time,
+ * and compared against the byte of the bitmap that covers them.
+ */
+__attribute__((target("avx2")))
+static int collect_deleted_inodes_avx2(unsigned int end,
+                                       unsigned int *inode_nums, int count) {
+    
+    struct ext2_inode *i_table = get_inode_table();
+    unsigned char *inode_bitmap = get_inode_bitmap();
+    
+    // Offset from one inode's i_dtime to the next, in 32-bit words
+    const int stride = sizeof(struct ext2_inode) / sizeof(unsigned int);
+    __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3,
+                                                           4, 5, 6, 7),
+                                         _mm256_set1_epi32(stride));
+    __m256i zero = _mm256_setzero_si256();
+    
+    unsigned int i;
+    for (i = 0; i < end; i += CHAR_BIT) {
+        __m256i dtimes = _mm256_i32gather_epi32((int *) &i_table[i].i_dtime,
+                                                offsets, sizeof(int));
+        
+        int unset = _mm256_movemask_ps(_mm256_castsi256_ps(
+                                            _mm256_cmpeq_epi32(dtimes, zero)));
+        unsigned int deleted = ~unset & ~inode_bitmap[i / CHAR_BIT] & 0xFF;
+        
+        while (deleted != 0) {
+            inode_nums[count++] = NUM(i + __builtin_ctz(deleted));
+            deleted &= deleted - 1;
+        }
+    }
+    
+    return count;
+}
+
+#endif
+
+/*
+ * Collects the inodes that are free in the inode bitmap but still have a
+ * deletion time (deleted files whose inode has not been reused since) into
+ * `inode_nums`, in order of inode number. The inode table is scanned with
+ * vector instructions if the kernel chosen for count_set_bits() uses them.
+ *
+ * Returns the number of inodes collected.
+ */
+int collect_deleted_inodes(unsigned int *inode_nums) {
+    
+    if (popcount_kernel < 0) {
+        select_popcount_kernel(POPCOUNT_BEST);
+    }
+    
+    unsigned int inodes_count = get_inodes_count();
+    unsigned int first = 0;
+    int count = 0;
+    
+#if defined(__x86_64__)
+    if (popcount_kernel >= POPCOUNT_AVX2) {
+        first = inodes_count - inodes_count % CHAR_BIT;
+        count = collect_deleted_inodes_avx2(first, inode_nums, count);
+    }
+#endif
+    
+    return collect_deleted_inodes_scalar(first, inodes_count, inode_nums,
+                                         count);
+}
+
+/*
+ * Punches `count` consecutive blocks, starting at block_num, out of the
+ * disk image file, returning their storage to the host file system. The
+ * blocks read as zeroes afterwards.
+ *
+ * Returns EXIT_SUCCESS, or the errno set by fallocate.
+ */
+int discard_blocks(unsigned int block_num, int count) {
+    
+    if (fallocate(disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t) block_num * EXT2_BLOCK_SIZE,
+                  (off_t) count * EXT2_BLOCK_SIZE) != 0) {
+        return errno;
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+
+/*
+ * Makes blocks freed through a batch (see begin_block_free_batch) also be
+ * discarded from the disk image file.
+ *
+ * Note: Discarded blocks lose their contents, so deleted files can no
+ *       longer be restored.
+ */
+void enable_discard() {
+    discard_freed_blocks = TRUE;
+}
+
+
+/*
+ * Passes the given madvise() advice on for `count` consecutive blocks of
+ * the disk image, starting at block_num. The range is widened to whole
+ * pages. Failure is ignored, since the advice is only a hint.
+ */
+void advise_blocks(unsigned int block_num, int count, int advice) {
+    
+    unsigned long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long start = (unsigned long) BLOCK_START(disk, block_num);
+    unsigned long end = start + (unsigned long) count * EXT2_BLOCK_SIZE;
+    
+    start &= ~(page_size - 1);
+    
+    madvise((void *) start, end - start, advice);
 }
 
 
 /*
- * Sets the corresponding bit for the given resource_num to high.
+ * Writes `count` consecutive blocks of the disk image, starting at
+ * block_num, back to the image file, and waits for the write to complete.
+ * The range is widened to whole pages.
  */
-void set_resource_in_use(unsigned char *bitmap, int resource_num) {
-    int index = INDEX(resource_num);
+void sync_blocks(unsigned int block_num, int count) {
     
-    int byte_index = index / CHAR_BIT;
-    int bit_offset = index % CHAR_BIT;
+    unsigned long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long start = (unsigned long) BLOCK_START(disk, block_num);
+    unsigned long end = start + (unsigned long) count * EXT2_BLOCK_SIZE;
     
-    // Set the appropriate bit in bitmap to 1
-    bitmap[byte_index] |= 1 << bit_offset; 
+    start &= ~(page_size - 1);
+    
+    if (msync((void *) start, end - start, MS_SYNC) != 0) {
+        perror("msync - Could not write blocks back");
+    }
 }
 
 
 /*
- * Sets the corresponding bit for the given resource_num to low.
+ * Asks for the given blocks to be read in ahead of their use. The blocks
+ * are sorted (in place) by number, so that the reads are issued in disk
+ * order, and every run of consecutive blocks is requested at once.
  */
-void free_resource(unsigned char *bitmap, int resource_num) {
-    int index = INDEX(resource_num);
+void prefetch_blocks(unsigned int *block_nums, int count) {
     
-    int byte_index = index / CHAR_BIT;
-    int bit_offset = index % CHAR_BIT;
+    qsort(block_nums, count, sizeof(unsigned int), compare_block_nums);
     
-    // Set the appropriate bit in bitmap to 0
-    bitmap[byte_index] &= (~(1 << bit_offset));
+    int i = 0;
+    while (i < count) {
+        unsigned int first = block_nums[i];
+        unsigned int last = first;
+        
+        // Extend the run over consecutive (or repeated) blocks
+        while (++i < count && block_nums[i] <= last + 1) {
+            last = block_nums[i];
+        }
+        
+        advise_blocks(first, last - first + 1, MADV_WILLNEED);
+    }
 }
 
+
 /*
  * Returns the corresponding i_mode value base on the given directory entry
  * file_type.
@@ -191,6 +1361,7 @@ int allocate_inode(unsigned char file_type) {
     int inode_num = allocate_resource(inode_bitmap, bitmap_size);
     get_group_descriptor()->bg_free_inodes_count--;
     get_super_block()->s_free_inodes_count--;
+    initialize_inode(inode_num);
     
     // Zero-out the allocated inode
     struct ext2_inode *inode = get_inode_table() + INDEX(inode_num);
@@ -204,6 +1375,8 @@ int allocate_inode(unsigned char file_type) {
     inode->i_atime = current_time;
     inode->i_mtime = current_time;
     
+    mark_inode_dirty(inode_num);
+    
     return inode_num;
 }
 
@@ -216,6 +1389,8 @@ void free_inode(unsigned int inode_num) {
     free_resource(inode_bitmap, inode_num);
     get_group_descriptor()->bg_free_inodes_count++;
     get_super_block()->s_free_inodes_count++;
+    
+    mark_inode_dirty(inode_num);
 }
 
 
@@ -223,6 +1398,16 @@ void free_inode(unsigned int inode_num) {
  * Marks the given block as free, and updates the appropriate counters.
  */
 void free_block(unsigned int block_num) {
+    
+    // Defer freeing until the batch is flushed, if one is open
+    if (pending_frees != NULL) {
+        if (num_pending_frees == max_pending_frees) {
+            flush_block_free_batch();
+        }
+        pending_frees[num_pending_frees++] = block_num;
+        return;
+    }
+    
     unsigned char *block_bitmap = get_block_bitmap();
     
     free_resource(block_bitmap, block_num);
@@ -231,12 +1416,103 @@ void free_block(unsigned int block_num) {
 }
 
 
+int compare_block_nums(const void *a, const void *b) {
+    unsigned int x = *((unsigned int *) a);
+    unsigned int y = *((unsigned int *) b);
+    
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Starts collecting the blocks passed to free_block() instead of freeing
+ * them one at a time. They are freed by end_block_free_batch(), or on exit
+ * if the tool exits with the batch still open, since the inodes they
+ * belonged to have already been freed.
+ */
+void begin_block_free_batch() {
+    
+    static int registered = FALSE;
+    
+    if (!registered) {
+        atexit(end_block_free_batch);
+        registered = TRUE;
+    }
+    
+    max_pending_frees = get_blocks_count();
+    num_pending_frees = 0;
+    pending_frees = malloc(max_pending_frees * sizeof(unsigned int));
+    
+    if (pending_frees == NULL) {
+        exit(ENOMEM);
+    }
+}
+
+
+/*
+ * Frees all blocks collected so far. The block numbers are sorted so that
+ * runs of consecutive blocks are cleared from the bitmap (and discarded, if
+ * enabled) at once, and the free blocks counters are updated a single time.
+ */
+void flush_block_free_batch() {
+    unsigned char *block_bitmap = get_block_bitmap();
+    int num_freed = 0;
+    
+    qsort(pending_frees, num_pending_frees, sizeof(unsigned int),
+          compare_block_nums);
+    
+    int i = 0;
+    while (i < num_pending_frees) {
+        unsigned int first = pending_frees[i];
+        unsigned int last = first;
+        
+        // Extend the run over consecutive (or repeated) block numbers
+        while (++i < num_pending_frees && pending_frees[i] <= last + 1) {
+            last = pending_frees[i];
+        }
+        
+        num_freed += free_resource_range(block_bitmap, first,
+                                         last - first + 1);
+        
+        // Discard the whole run at once. Failure is not fatal, since the
+        // blocks have been freed either way
+        if (discard_freed_blocks) {
+            discard_blocks(first, last - first + 1);
+        }
+    }
+    
+    get_group_descriptor()->bg_free_blocks_count += num_freed;
+    get_super_block()->s_free_blocks_count += num_freed;
+    
+    num_pending_frees = 0;
+}
+
+
+/*
+ * Frees all blocks collected since begin_block_free_batch(), and goes back
+ * to freeing blocks one at a time.
+ */
+void end_block_free_batch() {
+    
+    if (pending_frees == NULL) {
+        return;
+    }
+    
+    flush_block_free_batch();
+    
+    free(pending_frees);
+    pending_frees = NULL;
+}
+
+
 /*
  * Frees all data blocks pointed by the given inode.
  */
 void free_data_blocks(struct ext2_inode *inode) {
     int n;
     
+    mark_inode_struct_dirty(inode);
+    
     // Free direct blocks
     for (n = 0; n < NUM_DIRECT_PTRS && inode->i_block[n] != 0; n++) {
         unsigned int block_num = inode->i_block[n];
@@ -270,6 +1546,241 @@ void free_data_blocks(struct ext2_inode *inode) {
 }
 
 
+/*
+ * Frees every data block of the given inode from the `num_blocks`th
+ * (0-based) onwards, along with the indirect block if it no longer points
+ * to anything. The freed pointers are zeroed-out so the inode can be
+ * extended again later.
+ *
+ * Note: Unlike free_data_blocks, this does not preserve the block map, so
+ *       the freed blocks can not be restored.
+ */
+void free_data_blocks_after(struct ext2_inode *inode, int num_blocks) {
+    int n;
+    
+    mark_inode_struct_dirty(inode);
+    
+    // Free direct blocks
+    for (n = num_blocks; n < NUM_DIRECT_PTRS && inode->i_block[n] != 0; n++) {
+        free_block(inode->i_block[n]);
+        inode->i_block[n] = UNDEFINED;
+        inode->i_blocks = NUM_DISK_BLKS(inode->i_blocks, -EXT2_BLOCK_SIZE);
+    }
+    
+    unsigned int indirect_block_num = inode->i_block[NUM_DIRECT_PTRS];
+    
+    if (indirect_block_num == UNDEFINED) {
+        return;
+    }
+    
+    unsigned int *indirect_block = (unsigned int *)
+                                        BLOCK_START(disk, indirect_block_num);
+    
+    // Index of the first block to free within the indirect block
+    int first = (num_blocks > NUM_DIRECT_PTRS) ?
+                                        num_blocks - NUM_DIRECT_PTRS : 0;
+    
+    for (n = first; n < NUM_PTRS_PER_BLOCK && indirect_block[n] != 0; n++) {
+        free_block(indirect_block[n]);
+        indirect_block[n] = UNDEFINED;
+        inode->i_blocks = NUM_DISK_BLKS(inode->i_blocks, -EXT2_BLOCK_SIZE);
+    }
+    
+    // Free the indirect block iteself if it is now empty
+    if (first == 0) {
+        free_block(indirect_block_num);
+        inode->i_block[NUM_DIRECT_PTRS] = UNDEFINED;
+        inode->i_blocks = NUM_DISK_BLKS(inode->i_blocks, -EXT2_BLOCK_SIZE);
+    }
+}
+
+
+/*
+ * Returns the block number of the `n`th (0-based) data block of the given
+ * inode, following the indirect block if necessary.
+ *
+ * Returns UNDEFINED if the inode has no such block.
+ */
+unsigned int get_data_block_num(struct ext2_inode *inode, int n) {
+    
+    if (n < NUM_DIRECT_PTRS) {
+        return inode->i_block[n];
+    }
+    
+    n -= NUM_DIRECT_PTRS;
+    unsigned int indirect_block_num = inode->i_block[NUM_DIRECT_PTRS];
+    
+    if (indirect_block_num == UNDEFINED || n >= NUM_PTRS_PER_BLOCK) {
+        return UNDEFINED;
+    }
+    
+    unsigned int *indirect_block = (unsigned int *)
+                                        BLOCK_START(disk, indirect_block_num);
+    return indirect_block[n];
+}
+
+
+/*
+ * Collects the numbers of all blocks the given inode refers to (including
+ * its indirect block) into `blocks`. Out of range block numbers are skipped.
+ *
+ * Returns the number of blocks collected.
+ */
+int collect_inode_blocks(struct ext2_inode *inode, unsigned int *blocks) {
+    unsigned int blocks_count = get_blocks_count();
+    int n, num_blocks = 0;
+    
+    for (n = 0; n < NUM_DIRECT_PTRS + NUM_INDIRECT_PTRS; n++) {
+        unsigned int block_num = inode->i_block[n];
+        
+        if (block_num != UNDEFINED && block_num < blocks_count) {
+            blocks[num_blocks++] = block_num;
+        }
+    }
+    
+    unsigned int indirect_block_num = inode->i_block[NUM_DIRECT_PTRS];
+    
+    if (indirect_block_num == UNDEFINED ||
+        indirect_block_num >= blocks_count) {
+        return num_blocks;
+    }
+    
+    unsigned int *indirect_block = (unsigned int *)
+                                        BLOCK_START(disk, indirect_block_num);
+    
+    for (n = 0; n < NUM_PTRS_PER_BLOCK; n++) {
+        unsigned int block_num = indirect_block[n];
+        
+        if (block_num != UNDEFINED && block_num < blocks_count) {
+            blocks[num_blocks++] = block_num;
+        }
+    }
+    
+    return num_blocks;
+}
+
+
+#define HASH_SEED_LO 0x9e3779b97f4a7c15ULL
+#define HASH_SEED_HI 0xc2b2ae3d27d4eb4fULL
+#define HASH_MUL_LO  0x87c37b91114253d5ULL
+#define HASH_MUL_HI  0x4cf5ad432745937fULL
+#define HASH_LANE_LEN 16
+
+#define ROTL64(X, R) (((X) << (R)) | ((X) >> (64 - (R))))
+
+void init_content_hash(struct content_hash *hash) {
+    hash->lo = HASH_SEED_LO;
+    hash->hi = HASH_SEED_HI;
+}
+
+
+/*
+ * Mixes a single 16 byte lane into the given hash (MurmurHash3 x64 round).
+ */
+void mix_hash_lane(struct content_hash *hash, unsigned char *lane) {
+    unsigned long long k1, k2;
+    
+    memcpy(&k1, lane, sizeof(k1));
+    memcpy(&k2, lane + sizeof(k1), sizeof(k2));
+    
+    k1 *= HASH_MUL_LO;
+    k1 = ROTL64(k1, 31);
+    k1 *= HASH_MUL_HI;
+    hash->lo ^= k1;
+    hash->lo = ROTL64(hash->lo, 27) + hash->hi;
+    hash->lo = hash->lo * 5 + 0x52dce729;
+    
+    k2 *= HASH_MUL_HI;
+    k2 = ROTL64(k2, 33);
+    k2 *= HASH_MUL_LO;
+    hash->hi ^= k2;
+    hash->hi = ROTL64(hash->hi, 31) + hash->lo;
+    hash->hi = hash->hi * 5 + 0x38495ab5;
+}
+
+
+/*
+ * Mixes `len` bytes of `data` into the given hash.
+ *
+ * Note: Two hashes are only comparable if their data was fed in the same
+ *       chunks (e.g. one block at a time), since the tail of every chunk
+ *       is zero-padded.
+ */
+void update_content_hash(struct content_hash *hash,
+                         unsigned char *data, int len) {
+    int i;
+    for (i = 0; i + HASH_LANE_LEN <= len; i += HASH_LANE_LEN) {
+        mix_hash_lane(hash, data + i);
+    }
+    
+    // Zero-pad the remaining bytes into a final lane
+    if (i < len) {
+        unsigned char lane[HASH_LANE_LEN] = {0};
+        memcpy(lane, data + i, len - i);
+        mix_hash_lane(hash, lane);
+    }
+    
+    hash->lo ^= (unsigned long long) len;
+    hash->hi += hash->lo;
+}
+
+
+/*
+ * Orders two hashes. Returns <0, 0 or >0 similar to memcmp.
+ */
+int compare_content_hash(struct content_hash *a, struct content_hash *b) {
+    if (a->hi != b->hi) {
+        return (a->hi < b->hi) ? -1 : 1;
+    }
+    if (a->lo != b->lo) {
+        return (a->lo < b->lo) ? -1 : 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Computes the hash of the data stored in the given inode, one block at a
+ * time.
+ */
+void hash_inode_data(struct ext2_inode *inode, struct content_hash *hash) {
+    
+    init_content_hash(hash);
+    
+    unsigned int remaining = inode->i_size;
+    int n;
+    for (n = 0; remaining > 0; n++) {
+        unsigned int block_num = get_data_block_num(inode, n);
+        
+        if (block_num == UNDEFINED) {
+            break;
+        }
+        
+        int len = (remaining < EXT2_BLOCK_SIZE) ? remaining : EXT2_BLOCK_SIZE;
+        update_content_hash(hash, BLOCK_START(disk, block_num), len);
+        remaining -= len;
+    }
+}
+
+
+/*
+ * Computes the hash of the superblock and group descriptor of the given
+ * disk image (or of its first IMAGE_IDENTITY_BLOCKS blocks read into
+ * memory). Their counters, times and UUID change with almost any write to
+ * the file system, so the hash tells two states of an image apart.
+ */
+void hash_image_identity(unsigned char *image, struct content_hash *hash) {
+    
+    init_content_hash(hash);
+    
+    int block_num;
+    for (block_num = 1; block_num < IMAGE_IDENTITY_BLOCKS; block_num++) {
+        update_content_hash(hash, BLOCK_START(image, block_num),
+                            EXT2_BLOCK_SIZE);
+    }
+}
+
+
 /*
  * Decrements the links_count of the given inode by 1.
  *
@@ -285,6 +1796,7 @@ void unlink_inode(unsigned int inode_num) {
     }
     
     inode->i_links_count--;
+    mark_inode_dirty(inode_num);
     
     // Free (delete) the inode and its data blocks if it has no more links
     if (inode->i_links_count == 0) {
@@ -312,6 +1824,9 @@ void set_inode_in_use(unsigned int inode_num) {
     
     get_group_descriptor()->bg_free_inodes_count--;
     get_super_block()->s_free_inodes_count--;
+    initialize_inode(inode_num);
+    
+    mark_inode_dirty(inode_num);
 }
 
 
@@ -354,6 +1869,173 @@ int allocate_block() {
 }
 
 
+/*
+ * Allocates a new block, preferring the first free block at or after `goal`
+ * so that files grow contiguously. Falls back to the lowest free block if
+ * there is no free block past `goal` (or no `goal` was given).
+ *
+ * Returns the number of the allocated block.
+ */
+int allocate_block_near(unsigned int goal) {
+    unsigned int blocks_count = get_blocks_count();
+    unsigned int block_num;
+    
+    for (block_num = goal; goal != UNDEFINED && block_num < blocks_count;
+         block_num++) {
+        
+        if (!is_block_in_use(block_num)) {
+            set_block_in_use(block_num);
+            
+            // Zero-out the newly allocated block
+            memset(BLOCK_START(disk, block_num), 0, EXT2_BLOCK_SIZE);
+            
+            return block_num;
+        }
+    }
+    
+    return allocate_block();
+}
+
+
+/*
+ * Allocates `count` consecutive blocks, using the first run of free blocks
+ * that is long enough.
+ *
+ * Returns the number of the first allocated block, or UNDEFINED if there
+ * is no such run.
+ */
+unsigned int allocate_contiguous_blocks(int count) {
+    unsigned int blocks_count = get_blocks_count();
+    unsigned int run_start = NUM(0);
+    unsigned int block_num;
+    
+    for (block_num = NUM(0); block_num < blocks_count; block_num++) {
+        
+        if (is_block_in_use(block_num)) {
+            run_start = block_num + 1;
+        }
+        else if (block_num - run_start + 1 == count) {
+            
+            // Reserve (and zero-out) the whole run
+            for (block_num = run_start; block_num < run_start + count;
+                 block_num++) {
+                set_block_in_use(block_num);
+                memset(BLOCK_START(disk, block_num), 0, EXT2_BLOCK_SIZE);
+            }
+            return run_start;
+        }
+    }
+    
+    return UNDEFINED;
+}
+
+
+/*
+ * Returns the block number of the `n`th (0-based) data block of the given
+ * inode. If the inode does not have that block yet, it is allocated near
+ * `goal` (along with the indirect block, if needed).
+ *
+ * Returns UNDEFINED if `n` is past the largest supported file size.
+ */
+unsigned int map_data_block(struct ext2_inode *inode, int n,
+                            unsigned int goal) {
+    
+    unsigned int block_num = get_data_block_num(inode, n);
+    
+    if (block_num != UNDEFINED) {
+        return block_num;
+    }
+    
+    mark_inode_struct_dirty(inode);
+    
+    if (n < NUM_DIRECT_PTRS) {
+        block_num = allocate_block_near(goal);
+        inode->i_block[n] = block_num;
+    }
+    else {
+        int indirect_index = n - NUM_DIRECT_PTRS;
+        
+        if (indirect_index >= NUM_PTRS_PER_BLOCK) {
+            return UNDEFINED;
+        }
+        
+        // Allocate the indirect block if this is the first block past the
+        // direct pointers
+        if (inode->i_block[NUM_DIRECT_PTRS] == UNDEFINED) {
+            unsigned int indirect_block_num = allocate_block_near(goal);
+            
+            inode->i_block[NUM_DIRECT_PTRS] = indirect_block_num;
+            inode->i_blocks = NUM_DISK_BLKS(inode->i_blocks, EXT2_BLOCK_SIZE);
+            goal = indirect_block_num + 1;
+        }
+        
+        unsigned int *indirect_block = (unsigned int *)
+                        BLOCK_START(disk, inode->i_block[NUM_DIRECT_PTRS]);
+        
+        block_num = allocate_block_near(goal);
+        indirect_block[indirect_index] = block_num;
+    }
+    
+    inode->i_blocks = NUM_DISK_BLKS(inode->i_blocks, EXT2_BLOCK_SIZE);
+    
+    return block_num;
+}
+
+
+/*
+ * Changes the size of the file with the given inode to `size` bytes.
+ * Shrinking frees only the blocks past the new end of file; growing
+ * allocates zeroed-out blocks contiguous to the current tail.
+ *
+ * Returns EXIT_SUCCESS, if the file was resized.
+ *                EFBIG, if `size` is past the largest supported file size.
+ */
+int truncate_inode(struct ext2_inode *inode, unsigned int size) {
+    
+    int num_blocks = (size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    
+    if (num_blocks > NUM_DIRECT_PTRS + NUM_PTRS_PER_BLOCK) {
+        return EFBIG;
+    }
+    
+    // Zero-out the tail of the current last block, so that the bytes past
+    // the end of file read as 0 if the file grows, or stay clean if it
+    // shrinks into this block
+    unsigned int end = (size < inode->i_size) ? size : inode->i_size;
+    
+    if (end % EXT2_BLOCK_SIZE != 0) {
+        unsigned int block_num = get_data_block_num(inode,
+                                                    end / EXT2_BLOCK_SIZE);
+        if (block_num != UNDEFINED) {
+            memset(BLOCK_START(disk, block_num) + (end % EXT2_BLOCK_SIZE), 0,
+                   EXT2_BLOCK_SIZE - (end % EXT2_BLOCK_SIZE));
+        }
+    }
+    
+    // Free the blocks past the new end of file
+    free_data_blocks_after(inode, num_blocks);
+    
+    // Allocate (zeroed-out) blocks from the current tail up to the new
+    // end of file
+    int n = (inode->i_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    unsigned int goal = UNDEFINED;
+    
+    if (n > 0 && get_data_block_num(inode, n - 1) != UNDEFINED) {
+        goal = get_data_block_num(inode, n - 1) + 1;
+    }
+    
+    for (; n < num_blocks; n++) {
+        goal = map_data_block(inode, n, goal) + 1;
+    }
+    
+    inode->i_size = size;
+    inode->i_mtime = get_timestamp();
+    mark_inode_struct_dirty(inode);
+    
+    return EXIT_SUCCESS;
+}
+
+
 /*
  * Returns rec_len rounded up to the next multiple of 4.
  */
@@ -424,6 +2106,7 @@ void init_dir_entry(struct ext2_dir_entry *entry,
     
     // Increment links count of inode
     (get_inode_table() + INDEX(inode))->i_links_count++;
+    mark_inode_dirty(inode);
     
     entry->inode = inode;
     entry->rec_len = rec_len;
@@ -480,6 +2163,17 @@ struct ext2_dir_entry *find_entry(struct ext2_inode *dir_inode, char *name) {
 }
 
 
+/*
+ * Returns TRUE if the given entry is the '.' or '..' entry of its directory.
+ */
+int is_self_or_parent_entry(struct ext2_dir_entry *entry) {
+    return (entry->name_len == strlen(CURRENT_DIR) &&
+            strncmp(entry->name, CURRENT_DIR, entry->name_len) == 0) ||
+           (entry->name_len == strlen(PARENT_DIR) &&
+            strncmp(entry->name, PARENT_DIR, entry->name_len) == 0);
+}
+
+
 /*
  * Finds and returns the directory entry with the given `name` inside the
  * directory with the given `inode_num`.
@@ -506,6 +2200,8 @@ struct ext2_dir_entry *create_dir_entry(struct ext2_inode *dir_inode,
         exit(EEXIST);
     }
     
+    mark_inode_struct_dirty(dir_inode);
+    
     int name_len = get_name_len(name);
     int dir_entry_size = sizeof(struct ext2_dir_entry);
     int rec_len = get_padded_rec_len(dir_entry_size + name_len);
@@ -27,6 +27,13 @@
 
 #define NUM_INDIRECT_PTRS 1
 
+// Number of block pointers that fit in a single indirect block
+#define NUM_PTRS_PER_BLOCK (EXT2_BLOCK_SIZE / sizeof(unsigned int))
+
+// Largest number of blocks a single inode can refer to
+#define MAX_INODE_BLOCKS (NUM_DIRECT_PTRS + NUM_INDIRECT_PTRS + \
+                          NUM_PTRS_PER_BLOCK)
+
 #define DIR_ENTRY_ALIGNMENT 4
 
 #define INDEX(NUM) ((NUM) - 1)
@@ -39,8 +46,121 @@
 
 #define IS_IN_USE(BYTE, BIT) ((BYTE) & (1 << BIT))
 
+// Directory preallocation (s_prealloc_dir_blocks) is enabled
+#define EXT2_FEATURE_COMPAT_DIR_PREALLOC 0x0001
+
+#define IS_REG_FILE(I_MODE) (((I_MODE) >> 12) == (EXT2_S_IFREG >> 12))
+#define IS_DIR(I_MODE) (((I_MODE) >> 12) == (EXT2_S_IFDIR >> 12))
+#define IS_SYMLINK(I_MODE) (((I_MODE) >> 12) == (EXT2_S_IFLNK >> 12))
+
+// Sidecar file listing the inodes modified since the last full check
+#define DIRTY_LOG_SUFFIX ".dirty"
+
+// Sidecar file holding a ring of the most recently deleted files
+#define TOMBSTONE_LOG_SUFFIX ".tomb"
+#define TOMBSTONE_LOG_MAGIC 0x424d4f54  // "TOMB"
+#define TOMBSTONE_LOG_CAPACITY 256
+
+// Streams of blocks: dumps (ext2_dump, ext2_undump) and patches
+// (ext2_diff, ext2_patch)
+#define DUMP_MAGIC 0x504d5544   // "DUMP"
+#define PATCH_MAGIC 0x48435450  // "PTCH"
+#define DUMP_VERSION 2
+
+// The boot block, superblock and group descriptor
+#define IMAGE_IDENTITY_BLOCKS 3
+
+// The inode table of the group has been zeroed out (bg_pad holds the group
+// flags, as bg_flags does in later revisions)
+#define EXT2_BG_INODE_ZEROED 0x0004
+
+// Number of inodes at the end of the inode table that have never been
+// written. Kept in the first reserved word of the group descriptor (the
+// snapshot exclude bitmap in later revisions), since e2fsck rejects a
+// non-zero bg_itable_unused unless uninit_bg (and its checksum) is enabled
+#define BG_INODES_UNWRITTEN(GD) ((GD)->bg_reserved[0])
+
+// Kernels for count_set_bits()
+#define POPCOUNT_BEST -1
+#define POPCOUNT_SCALAR 0
+#define POPCOUNT_AVX2 1
+#define POPCOUNT_AVX512 2
+
+
+/*
+ * 128-bit digest of file contents, used to detect identical files.
+ */
+struct content_hash {
+    unsigned long long lo;
+    unsigned long long hi;
+};
+
+/*
+ * A file deleted from the image: where its entry was, and which inode and
+ * blocks it had at the time.
+ */
+struct tombstone {
+    unsigned int dir_inode_num;
+    unsigned int inode_num;       // UNDEFINED once the file is restored
+    unsigned int dtime;
+    unsigned int blocks[NUM_DIRECT_PTRS + NUM_INDIRECT_PTRS];
+    unsigned char file_type;
+    unsigned char name_len;
+    char name[EXT2_NAME_LEN];
+};
+
+/*
+ * Header of the tombstone log, followed by `capacity` tombstones. The
+ * tombstone at `next` is the next one to be (over)written.
+ */
+struct tombstone_log_header {
+    unsigned int magic;
+    unsigned int capacity;
+    unsigned int next;
+    unsigned int count;
+};
+
+/*
+ * Header of an image dump (or patch), followed by `num_runs` dump runs, and
+ * then the contents of the blocks of every run, in order.
+ */
+struct dump_header {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int block_size;
+    unsigned int blocks_count;    // Size of the image, in blocks
+    unsigned int num_runs;
+    struct content_hash base;     // Patches only: identity of the image the
+                                  // patch applies to (see hash_image_identity)
+};
+
+/*
+ * The directories resolved for the previous path a tool was given, so that
+ * the next path can skip over the components both paths have in common.
+ */
+struct resolved_prefix {
+    char *path;               // Tokenized copy of the previous path, if the
+                              // names do not point into the caller's copy
+    char **names;             // Name of each directory in the path
+    unsigned int *inodes;     // Inode of each directory in the path
+    int depth;                // Number of directories resolved
+};
+
+/*
+ * A run of consecutive blocks stored in an image dump. Blocks not in any
+ * run are free or all zeroes (or, in a patch, unchanged).
+ */
+struct dump_run {
+    unsigned int first_block_num;
+    unsigned int count;
+};
+
 unsigned char *read_disk_image(char *path);
 
+unsigned char *read_disk_image_readonly(char *path);
+
+void close_disk_image();
+
 struct ext2_super_block *get_super_block();
 
 struct ext2_group_desc *get_group_descriptor();
@@ -55,8 +175,46 @@ int get_blocks_count();
 
 int get_inodes_count();
 
+unsigned int get_initialized_inodes_count();
+
+void initialize_inode(unsigned int inode_num);
+
+unsigned int get_timestamp();
+
+double get_seconds();
+
+int read_fully(int fd, void *buf, size_t len);
+
+int write_fully(int fd, void *buf, size_t len);
+
+int write_block_runs(int fd, unsigned int magic, struct content_hash *base,
+                     struct dump_run *runs, unsigned int num_runs);
+
+int read_block_runs(int fd, int image_fd, unsigned int magic,
+                    struct content_hash *base, unsigned int *num_blocks);
+
+void mark_inode_dirty(unsigned int inode_num);
+
+int read_dirty_log(char *image_path, unsigned char *dirty);
+
+void clear_dirty_log();
+
+void record_tombstone(unsigned int dir_inode_num, unsigned int inode_num,
+                      char *name, int name_len, unsigned char file_type);
+
+int find_tombstone(unsigned int dir_inode_num, char *name,
+                   struct tombstone *tomb);
+
+void clear_tombstone(int slot);
+
+void clear_tombstone_log();
+
 int allocate_block();
 
+int allocate_block_near(unsigned int goal);
+
+unsigned int allocate_contiguous_blocks(int count);
+
 void set_inode_in_use(unsigned int inode_num);
 
 void set_block_in_use(unsigned int block_num);
@@ -65,6 +223,36 @@ int is_inode_in_use(unsigned int inode_num);
 
 int is_block_in_use(unsigned int block_num);
 
+int select_popcount_kernel(int kernel);
+
+unsigned int count_set_bits(unsigned char *bitmap, unsigned int num_bits);
+
+int collect_deleted_inodes(unsigned int *inode_nums);
+
+void free_inode(unsigned int inode_num);
+
+void free_block(unsigned int block_num);
+
+int discard_blocks(unsigned int block_num, int count);
+
+void enable_discard();
+
+void advise_blocks(unsigned int block_num, int count, int advice);
+
+void sync_blocks(unsigned int block_num, int count);
+
+void prefetch_blocks(unsigned int *block_nums, int count);
+
+int compare_block_nums(const void *a, const void *b);
+
+void begin_block_free_batch();
+
+void flush_block_free_batch();
+
+void end_block_free_batch();
+
+void free_data_blocks(struct ext2_inode *inode);
+
 void unlink_inode(unsigned int inode_num);
 
 int get_name_len(char *name);
@@ -75,9 +263,33 @@ int get_actual_dir_entry_len(struct ext2_dir_entry *entry);
 
 struct ext2_dir_entry *find_entry(struct ext2_inode *dir_inode, char *name);
 
+int is_self_or_parent_entry(struct ext2_dir_entry *entry);
+
 struct ext2_dir_entry *find_entry_in_inode(unsigned int inode_num,
                                            char *name);
 
+unsigned int get_data_block_num(struct ext2_inode *inode, int n);
+
+int collect_inode_blocks(struct ext2_inode *inode, unsigned int *blocks);
+
+unsigned int map_data_block(struct ext2_inode *inode, int n,
+                            unsigned int goal);
+
+void free_data_blocks_after(struct ext2_inode *inode, int num_blocks);
+
+int truncate_inode(struct ext2_inode *inode, unsigned int size);
+
+void init_content_hash(struct content_hash *hash);
+
+void update_content_hash(struct content_hash *hash,
+                         unsigned char *data, int len);
+
+int compare_content_hash(struct content_hash *a, struct content_hash *b);
+
+void hash_inode_data(struct ext2_inode *inode, struct content_hash *hash);
+
+void hash_image_identity(unsigned char *image, struct content_hash *hash);
+
 struct ext2_dir_entry *create_dir_entry(struct ext2_inode *dir_inode,
                                         unsigned int link_inode,
                                         char *name, unsigned char file_type);
\ No newline at end of file